@@ -0,0 +1,82 @@
+#include <iostream>
+#include <vector>
+#include <chrono>
+#include <opencv2/core/core.hpp>
+
+#include "panorama.hpp"
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Microbenchmark for the homography transform. Compares the former cv::Mat
+ * based transform against Homography::apply() and Homography::transformRow()
+ * over the pixels of a canvas with the size of a typical panorama.
+ */
+
+// the former implementation, kept as reference
+static void htMat(double x0, double y0, Mat &H, double *x, double *y)
+{
+    Mat point1 = (Mat_<double>(3, 1) << x0, y0, 1.);
+    Mat point2 = H * point1;
+    *x = point2.at<double>(0, 0) / point2.at<double>(2, 0);
+    *y = point2.at<double>(1, 0) / point2.at<double>(2, 0);
+}
+
+static double elapsed(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+int main()
+{
+    const int width  = 1000;
+    const int height = 600;
+    const double points = (double) width * height;
+
+    Mat H = (Mat_<double>(3, 3) <<  0.9,  0.05,  120.,
+                                   -0.03, 1.02,   15.,
+                                    1e-5, 2e-5,    1.);
+    Homography Hh(H);
+
+    vector<double> xs(width), ys(width);
+    double checksum[3] = { 0., 0., 0. };
+
+    // cv::Mat temporaries for every point
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < height; i++) {
+        for (int j = 0; j < width; j++) {
+            htMat(j, i, H, &xs[j], &ys[j]);
+        }
+        checksum[0] += xs[width - 1] + ys[width - 1];
+    }
+    const double t_mat = elapsed(start);
+
+    // inline single point transform
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < height; i++) {
+        for (int j = 0; j < width; j++) {
+            Hh.apply(j, i, &xs[j], &ys[j]);
+        }
+        checksum[1] += xs[width - 1] + ys[width - 1];
+    }
+    const double t_apply = elapsed(start);
+
+    // incremental row transform
+    start = chrono::steady_clock::now();
+    for (int i = 0; i < height; i++) {
+        Hh.transformRow(0., i, width, xs.data(), ys.data());
+        checksum[2] += xs[width - 1] + ys[width - 1];
+    }
+    const double t_row = elapsed(start);
+
+    cout << "points:         " << width << "x" << height << endl;
+    cout << "cv::Mat:        " << t_mat   * 1e9 / points << " ns/point" << endl;
+    cout << "apply():        " << t_apply * 1e9 / points << " ns/point ("
+         << t_mat / t_apply << "x)" << endl;
+    cout << "transformRow(): " << t_row  * 1e9 / points << " ns/point ("
+         << t_mat / t_row << "x)" << endl;
+    cout << "checksums:      " << checksum[0] << " " << checksum[1] << " " << checksum[2] << endl;
+
+    return 0;
+}
@@ -0,0 +1,282 @@
+#include <iostream>
+#include <vector>
+#include <queue>
+#include <random>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <opencv2/core/core.hpp>
+#include <opencv2/features2d/features2d.hpp>  // DMatch
+
+#include "panorama.hpp"
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Benchmark of the stable marriage matching. Compares the former version on
+ * vector<vector<DMatch>> preference lists with linear scans against
+ * stableMarriage() on flat PreferenceTables, at 10k and 100k keypoints. The
+ * kNN search of the binary matcher is timed serially and with both
+ * directions running concurrently.
+ */
+
+static const int NOT_ENGAGED = -1;
+
+// the former implementation, kept as reference
+static void stableMarriageNested(const vector<vector<DMatch>>& acceptor_table,
+                                 const vector<vector<DMatch>>& proposor_table,
+                                 vector<DMatch>& matches)
+{
+    // Indicates that acceptor i is currently enganged
+    // to the proposer v[i]
+    vector<int> engagements(acceptor_table.size(), NOT_ENGAGED);
+
+    // queue of proposers that are not currently engaged
+    queue<int> free_proposers;
+
+    // mark every proposer as free
+    for (int i = 0; i < proposor_table.size(); i++) {
+        free_proposers.push(i);
+    }
+
+    // next[i] is the index of the accecptor to whom
+    // proposer[i] has not yet proposed
+    vector<int> next(proposor_table.size(), 0);
+
+    while (!free_proposers.empty()) {
+        int p = free_proposers.front();
+        free_proposers.pop();
+
+        // Check if there are any further prefered
+        // acceptors for this proposer
+        if (next[p] >= proposor_table[p].size()) {
+            continue;
+        }
+
+        assert(p < proposor_table.size());
+        int a = proposor_table[p][next[p]++].trainIdx;
+
+        assert(a < engagements.size());
+
+        // if the acceptor has not been engaged yet,
+        // the proposal get immediately accepted
+        if (engagements[a] == NOT_ENGAGED) {
+            // It is important to check, if the current propser
+            // is contained in the preference list of the acceptor
+            for (int i = 0; i < acceptor_table[a].size(); i++) {
+
+                assert(i < acceptor_table[a].size());
+
+                if (acceptor_table[a][i].trainIdx == p) {
+                    engagements[a] = p;
+                    break;
+                }
+            }
+            // The proposer was not in the preference list. Therefore
+            // the proposer stays free
+            if (engagements[a] == NOT_ENGAGED) {
+                free_proposers.push(p);
+            }
+        } else {
+            // the current fiance of the 
+            int fiance = engagements[a];
+
+            for (int i = 0; i < acceptor_table[a].size(); i++) {
+                assert(a == acceptor_table[a][i].queryIdx);
+
+                int preference = acceptor_table[a][i].trainIdx;
+
+                // the fiance has a higher preference
+                // for the acceptor
+                if (preference == fiance) {
+                    free_proposers.push(p);
+                    break;
+                }
+                // the current proposer has a higher preference
+                // than the fiance
+                else if (preference == p) {
+                    engagements[a] = p;
+                    free_proposers.push(fiance);
+                    break;
+                }
+            }
+        }
+    }
+
+    // Ensure the matches list is empty
+    matches.clear();
+
+    for (int i = 0; i < engagements.size(); i++) {
+        if (engagements[i] != NOT_ENGAGED) {
+
+            // ensure that the acceptor has this number of
+            // neighbors
+            // if (i < acceptor_table[i].size()) {
+
+                assert(i < acceptor_table.size());
+
+                // search for the DMatch where the related
+                // train index (index of the keypoint in the other
+                // image) equals the index of the husband
+                for (int j = 0; j < acceptor_table[i].size(); j++) {
+
+
+                    if (acceptor_table[i][j].trainIdx == engagements[i]) {
+                        matches.push_back(acceptor_table[i][j]);
+                        break;
+                    }
+                }
+            // }
+        }
+    }
+}
+
+
+
+static double elapsed(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * Synthetic kNN tables: every keypoint has a random position on a line, the
+ * right keypoints are a noisy permutation of the left ones. The neighbors are
+ * the k nearest positions on the other side.
+ */
+static void knnTable(const vector<double>& query, const vector<double>& train, const int k,
+                     vector<vector<DMatch>>& table)
+{
+    vector<pair<double, int>> sorted(train.size());
+    for (int i = 0; i < train.size(); i++) {
+        sorted[i] = make_pair(train[i], i);
+    }
+    sort(sorted.begin(), sorted.end());
+
+    table.assign(query.size(), vector<DMatch>());
+
+    for (int q = 0; q < query.size(); q++) {
+        int lo = lower_bound(sorted.begin(), sorted.end(), make_pair(query[q], -1)) - sorted.begin();
+        int hi = lo;
+        lo--;
+
+        // merge outwards from the position of the query
+        while (table[q].size() < k && (lo >= 0 || hi < sorted.size())) {
+            const double dlo = lo >= 0 ? query[q] - sorted[lo].first : 1e30;
+            const double dhi = hi < sorted.size() ? sorted[hi].first - query[q] : 1e30;
+
+            if (dlo <= dhi) {
+                table[q].push_back(DMatch(q, sorted[lo--].second, 0, (float) dlo));
+            } else {
+                table[q].push_back(DMatch(q, sorted[hi++].second, 0, (float) dhi));
+            }
+        }
+    }
+}
+
+static void benchMarriage(const int n, const int k)
+{
+    mt19937 rng(42);
+    uniform_real_distribution<double> uniform(0., 1.);
+    normal_distribution<double> noise(0., 0.5 / n);
+
+    vector<double> left(n), right(n);
+    for (int i = 0; i < n; i++) {
+        left[i] = uniform(rng);
+    }
+    vector<int> permutation(n);
+    for (int i = 0; i < n; i++) {
+        permutation[i] = i;
+    }
+    shuffle(permutation.begin(), permutation.end(), rng);
+    for (int i = 0; i < n; i++) {
+        right[permutation[i]] = left[i] + noise(rng);
+    }
+
+    vector<vector<DMatch>> acceptor_table, proposor_table;
+    knnTable(left, right, k, acceptor_table);
+    knnTable(right, left, k, proposor_table);
+
+    vector<DMatch> nested_matches, flat_matches;
+    PreferenceTable acceptors, proposers;
+
+    // best of some runs
+    double t_nested = 1e30, t_assign = 1e30, t_flat = 1e30;
+
+    for (int run = 0; run < 5; run++) {
+        auto start = chrono::steady_clock::now();
+        stableMarriageNested(acceptor_table, proposor_table, nested_matches);
+        t_nested = min(t_nested, elapsed(start));
+
+        // conversion of the knnMatch() result, knnMatchHamming() fills the
+        // flat tables directly
+        start = chrono::steady_clock::now();
+        acceptors.assign(acceptor_table, k);
+        proposers.assign(proposor_table, k);
+        t_assign = min(t_assign, elapsed(start));
+
+        start = chrono::steady_clock::now();
+        stableMarriage(acceptors, proposers, flat_matches);
+        t_flat = min(t_flat, elapsed(start));
+    }
+
+    bool equal = nested_matches.size() == flat_matches.size();
+    for (int i = 0; equal && i < flat_matches.size(); i++) {
+        equal = nested_matches[i].queryIdx == flat_matches[i].queryIdx
+             && nested_matches[i].trainIdx == flat_matches[i].trainIdx;
+    }
+
+    cout << "stable marriage, " << n << " keypoints, k = " << k << endl
+         << "  vector<vector<DMatch>>: " << t_nested * 1000. << " ms" << endl
+         << "  PreferenceTable:        " << t_flat   * 1000. << " ms ("
+         << t_nested / t_flat << "x)" << endl
+         << "  conversion to tables:   " << t_assign * 1000. << " ms" << endl
+         << "  " << flat_matches.size() << " matches, "
+         << (equal ? "identical" : "DIFFERENT") << endl;
+}
+
+static void benchHamming(const int n, const int k)
+{
+    mt19937 rng(42);
+
+    Mat left(n, 32, CV_8U), right(n, 32, CV_8U);
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < 32; j++) {
+            left.at<uchar>(i, j)  = rng();
+            right.at<uchar>(i, j) = rng();
+        }
+    }
+
+    PreferenceTable acceptors, proposers;
+
+    auto start = chrono::steady_clock::now();
+    knnMatchHamming(left, right, acceptors, k);
+    knnMatchHamming(right, left, proposers, k);
+    const double t_serial = elapsed(start);
+
+    start = chrono::steady_clock::now();
+    thread reverse([&]() {
+        knnMatchHamming(right, left, proposers, k);
+    });
+    knnMatchHamming(left, right, acceptors, k);
+    reverse.join();
+    const double t_concurrent = elapsed(start);
+
+    cout << "Hamming kNN in both directions, " << n << " keypoints, k = " << k << endl
+         << "  serial:     " << t_serial     * 1000. << " ms" << endl
+         << "  concurrent: " << t_concurrent * 1000. << " ms ("
+         << t_serial / t_concurrent << "x)" << endl;
+}
+
+int main()
+{
+    const int k = 10;
+
+    benchMarriage(10000, k);
+    benchMarriage(100000, k);
+
+    // the brute-force search is quadratic, 100k keypoints would take minutes
+    benchHamming(10000, k);
+
+    return 0;
+}
@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <iostream>
+#include <string.h>    // memcmp(), memcpy()
+#include <fcntl.h>     // open()
+#include <unistd.h>    // close()
+#include <sys/mman.h>  // mmap()
+#include <sys/stat.h>  // fstat(), mkdir()
+
+#include "panorama.hpp"
+
+using namespace std;
+using namespace cv;
+
+// identifies the file format, the last two characters are the version
+static const char CACHE_MAGIC[8] = { 'P', 'A', 'N', 'O', 'F', 'C', '0', '1' };
+
+/**
+ * Layout of a cache entry: the header, the keypoints as KEYPOINT_FIELDS
+ * 32 bit values each and the descriptor rows, which start at a multiple of
+ * 16 bytes.
+ */
+struct CacheHeader
+{
+    char     magic[8];
+    uint64_t key;
+    int32_t  keypoints;
+    int32_t  rows;        // descriptors
+    int32_t  cols;
+    int32_t  type;
+    uint64_t descriptors; // offset of the descriptors in the file
+};
+
+// x, y, size, angle, response, octave, class_id
+static const int KEYPOINT_FIELDS = 7;
+
+
+FeatureCache::FeatureCache(const string& directory) : directory(directory)
+{
+    if (enabled()) {
+        mkdir(directory.c_str(), 0755);
+    }
+}
+
+
+FeatureCache::~FeatureCache()
+{
+    for (int i = 0; i < mappings.size(); i++) {
+        munmap(mappings[i].first, mappings[i].second);
+    }
+}
+
+
+/**
+ * FNV-1a over 64 bit words of the image rows, the size, the type and the
+ * parameters
+ */
+uint64_t FeatureCache::key(const Mat& image, const string& parameters)
+{
+    const uint64_t prime = 1099511628211ull;
+    uint64_t hash = 14695981039346656037ull;
+
+    const int dims[3] = { image.rows, image.cols, image.type() };
+    for (int i = 0; i < 3; i++) {
+        hash = (hash ^ (uint64_t) dims[i]) * prime;
+    }
+
+    const size_t row_bytes = image.cols * image.elemSize();
+
+    for (int i = 0; i < image.rows; i++) {
+        const unsigned char *row = image.ptr(i);
+
+        size_t j = 0;
+        for (; j + 8 <= row_bytes; j += 8) {
+            uint64_t word;
+            memcpy(&word, row + j, 8);
+            hash = (hash ^ word) * prime;
+        }
+        for (; j < row_bytes; j++) {
+            hash = (hash ^ row[j]) * prime;
+        }
+    }
+
+    for (size_t j = 0; j < parameters.size(); j++) {
+        hash = (hash ^ (unsigned char) parameters[j]) * prime;
+    }
+
+    return hash;
+}
+
+
+string FeatureCache::filename(const uint64_t key) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.features", (unsigned long long) key);
+    return directory + "/" + name;
+}
+
+
+/**
+ * Maps the entry of the key. The keypoints are copied, the descriptors refer
+ * to the mapping.
+ *
+ * @return false if there is no valid entry
+ */
+bool FeatureCache::load(const uint64_t key, vector<KeyPoint>& keypoints, Mat& descriptors)
+{
+    if (!enabled()) {
+        return false;
+    }
+
+    const int fd = open(filename(key).c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(CacheHeader)) {
+        close(fd);
+        return false;
+    }
+
+    const size_t length = st.st_size;
+    void *data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        return false;
+    }
+
+    const CacheHeader *header = (const CacheHeader*) data;
+    const unsigned char *bytes = (const unsigned char*) data;
+
+    // the entry has to fit into the file
+    const size_t keypoint_bytes   = (size_t) header->keypoints * KEYPOINT_FIELDS * 4;
+    const size_t descriptor_bytes = (size_t) header->rows * header->cols * CV_ELEM_SIZE(header->type);
+
+    if (memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || header->key != key ||
+        header->keypoints < 0 || header->rows < 0 || header->cols < 0 ||
+        sizeof(CacheHeader) + keypoint_bytes > header->descriptors ||
+        header->descriptors + descriptor_bytes > length) {
+        munmap(data, length);
+        return false;
+    }
+
+    keypoints.resize(header->keypoints);
+
+    const unsigned char *p = bytes + sizeof(CacheHeader);
+    for (int i = 0; i < header->keypoints; i++, p += KEYPOINT_FIELDS * 4) {
+        float values[5];
+        int32_t ids[2];
+        memcpy(values, p, sizeof(values));
+        memcpy(ids, p + sizeof(values), sizeof(ids));
+
+        keypoints[i] = KeyPoint(values[0], values[1], values[2], values[3], values[4], ids[0], ids[1]);
+    }
+
+    descriptors = Mat(header->rows, header->cols, header->type, (void*) (bytes + header->descriptors));
+
+    lock_guard<std::mutex> lock(mutex);
+    mappings.push_back(make_pair(data, length));
+
+    return true;
+}
+
+
+/**
+ * Writes the entry of the key. It is written into a temporary file first and
+ * renamed, so a concurrent load never sees a partial entry.
+ */
+bool FeatureCache::store(const uint64_t key, const vector<KeyPoint>& keypoints, const Mat& descriptors)
+{
+    if (!enabled()) {
+        return false;
+    }
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.key       = key;
+    header.keypoints = keypoints.size();
+    header.rows      = descriptors.rows;
+    header.cols      = descriptors.cols;
+    header.type      = descriptors.type();
+
+    const size_t keypoint_bytes = keypoints.size() * KEYPOINT_FIELDS * 4;
+    header.descriptors = (sizeof(CacheHeader) + keypoint_bytes + 15) / 16 * 16;
+
+    const string name = filename(key);
+    const string temporary = name + ".tmp";
+
+    FILE *file = fopen(temporary.c_str(), "wb");
+    if (file == NULL) {
+        return false;
+    }
+
+    vector<unsigned char> buffer(header.descriptors, 0);
+    memcpy(&buffer[0], &header, sizeof(header));
+
+    unsigned char *p = &buffer[sizeof(CacheHeader)];
+    for (int i = 0; i < keypoints.size(); i++, p += KEYPOINT_FIELDS * 4) {
+        const KeyPoint& kp = keypoints[i];
+        const float values[5] = { kp.pt.x, kp.pt.y, kp.size, kp.angle, kp.response };
+        const int32_t ids[2]  = { kp.octave, kp.class_id };
+
+        memcpy(p, values, sizeof(values));
+        memcpy(p + sizeof(values), ids, sizeof(ids));
+    }
+
+    bool ok = fwrite(&buffer[0], 1, buffer.size(), file) == buffer.size();
+
+    const size_t row_bytes = descriptors.cols * descriptors.elemSize();
+    for (int i = 0; i < descriptors.rows && ok; i++) {
+        ok = fwrite(descriptors.ptr(i), 1, row_bytes, file) == row_bytes;
+    }
+
+    ok = (fclose(file) == 0) && ok;
+
+    if (!ok || rename(temporary.c_str(), name.c_str()) != 0) {
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
@@ -3,11 +3,13 @@
 #include <stdlib.h>
 #include <time.h>
 #include <fstream>
+#include <cmath>
+#include <algorithm>
+#include <random>
 
 // opencv
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
-#include <opencv2/calib3d/calib3d.hpp>
 #include <opencv2/features2d/features2d.hpp>  // DMatch
 
 #include "panorama.hpp"
@@ -16,82 +18,480 @@ using namespace std;
 using namespace cv;
 
 
-void findHomographyLR(const vector<KeyPoint>& keypoints_left, const vector<KeyPoint>& keypoints_right,
-                      const vector<DMatch>& matches, Mat& Hl, Mat& Hr)
+// number of alternating refinements of Hl and Hr in findHomographyLR()
+static const int JOINT_ITERATIONS = 4;
+
+// Gauss-Newton steps of a single refinement
+static const int GAUSS_NEWTON_STEPS = 3;
+
+// maximum reprojection error of a RANSAC inlier in pixels
+static const double RANSAC_THRESHOLD = 3.;
+
+// probability that RANSAC has drawn at least one outlier-free sample
+static const double RANSAC_CONFIDENCE = 0.995;
+
+static const int RANSAC_MAX_ITERATIONS = 2000;
+
+// fixed seed, so the estimates are reproducible
+static const unsigned RANSAC_SEED = 1;
+
+
+/**
+ * Similarity transform that moves the centroid of the points into the origin
+ * and scales their mean distance to the origin to sqrt(2)
+ */
+static Homography normalization(const Point2d *points, const int n)
 {
+    double cx = 0., cy = 0.;
+    for (int i = 0; i < n; i++) {
+        cx += points[i].x;
+        cy += points[i].y;
+    }
+    cx /= n;
+    cy /= n;
 
-    // find "usual" hopmgraphy: left->right
-    vector<Point2d> points_left;
-    vector<Point2d> points_right;
+    double dist = 0.;
+    for (int i = 0; i < n; i++) {
+        dist += sqrt((points[i].x - cx) * (points[i].x - cx) + (points[i].y - cy) * (points[i].y - cy));
+    }
+    const double s = (dist > 0.) ? sqrt(2.) * n / dist : 1.;
+
+    Homography T;
+    T.h[0] = s;
+    T.h[2] = -s * cx;
+    T.h[4] = s;
+    T.h[5] = -s * cy;
+    return T;
+}
+
+
+/**
+ * Solves the 8x8 linear system A x = b by Gaussian elimination with partial
+ * pivoting. A and b are overwritten.
+ *
+ * @return false if the system is singular
+ */
+static bool solve8(double A[8][8], double b[8], double x[8])
+{
+    for (int col = 0; col < 8; col++) {
+        int pivot = col;
+        for (int row = col + 1; row < 8; row++) {
+            if (fabs(A[row][col]) > fabs(A[pivot][col])) pivot = row;
+        }
+        if (fabs(A[pivot][col]) < 1e-12) {
+            return false;
+        }
+        if (pivot != col) {
+            for (int k = 0; k < 8; k++) std::swap(A[col][k], A[pivot][k]);
+            std::swap(b[col], b[pivot]);
+        }
+
+        for (int row = col + 1; row < 8; row++) {
+            const double f = A[row][col] / A[col][col];
+            for (int k = col; k < 8; k++) A[row][k] -= f * A[col][k];
+            b[row] -= f * b[col];
+        }
+    }
+
+    for (int row = 7; row >= 0; row--) {
+        double sum = b[row];
+        for (int k = row + 1; k < 8; k++) sum -= A[row][k] * x[k];
+        x[row] = sum / A[row][row];
+    }
+    return true;
+}
+
+
+/**
+ * Refines H by Gauss-Newton steps, minimizing the transfer error
+ * sum |H(src[i]) - dst[i]|^2 over the eight parameters with h[8] = 1. The
+ * points are normalized (see normalization()), so the normal equations are
+ * well conditioned. Nothing is allocated.
+ */
+void refineHomography(const Point2d *src, const Point2d *dst, const int n,
+                      Homography& H, const int steps)
+{
+    const Homography Ts = normalization(src, n);
+    const Homography Td = normalization(dst, n);
+
+    // H in normalized coordinates, scaled to g[8] = 1
+    Homography G = Td * H * Ts.inv();
+    const double scale = G.h[8];
+    for (int i = 0; i < 9; i++) {
+        G.h[i] /= scale;
+    }
+    double *g = G.h;
+
+    for (int step = 0; step < steps; step++) {
+        double JtJ[8][8] = {};
+        double Jtr[8] = {};
 
-    for (int i = 0; i < matches.size(); i++) {
-        points_left.push_back(keypoints_left[matches[i].queryIdx].pt);
-        points_right.push_back(keypoints_right[matches[i].trainIdx].pt);
+        for (int i = 0; i < n; i++) {
+            double sx, sy, dx, dy;
+            Ts.apply(src[i].x, src[i].y, &sx, &sy);
+            Td.apply(dst[i].x, dst[i].y, &dx, &dy);
+
+            const double w  = 1. / (g[6] * sx + g[7] * sy + 1.);
+            const double px = (g[0] * sx + g[1] * sy + g[2]) * w;
+            const double py = (g[3] * sx + g[4] * sy + g[5]) * w;
+
+            const double jx[8] = { sx * w, sy * w, w, 0., 0., 0., -px * sx * w, -px * sy * w };
+            const double jy[8] = { 0., 0., 0., sx * w, sy * w, w, -py * sx * w, -py * sy * w };
+
+            for (int r = 0; r < 8; r++) {
+                for (int c = r; c < 8; c++) {
+                    JtJ[r][c] += jx[r] * jx[c] + jy[r] * jy[c];
+                }
+                Jtr[r] += jx[r] * (dx - px) + jy[r] * (dy - py);
+            }
+        }
+
+        for (int r = 0; r < 8; r++) {
+            for (int c = 0; c < r; c++) {
+                JtJ[r][c] = JtJ[c][r];
+            }
+        }
+
+        double delta[8];
+        if (!solve8(JtJ, Jtr, delta)) {
+            break;
+        }
+
+        double norm = 0.;
+        for (int k = 0; k < 8; k++) {
+            g[k] += delta[k];
+            norm += delta[k] * delta[k];
+        }
+        if (norm < 1e-20) {
+            break;
+        }
     }
 
-    Mat H = findHomography(points_left, points_right, CV_RANSAC);
+    H = Td.inv() * G * Ts;
+}
+
 
-    // try to estimate the "middle one"
-    points_left.clear();
-    points_right.clear();
+/**
+ * Homography with h[8] = 1 through the four correspondences of a minimal
+ * sample, solved directly by the 8x8 linear system of the DLT.
+ *
+ * @return false if the sample is degenerate
+ */
+static bool solveMinimal(const double *xs, const double *ys, const double *us, const double *vs,
+                         const int sample[4], Homography& G)
+{
+    double A[8][8];
+    double b[8];
+
+    for (int k = 0; k < 4; k++) {
+        const int i = sample[k];
+        const double x = xs[i], y = ys[i], u = us[i], v = vs[i];
 
-    for (int i = 0; i < matches.size(); i++) {
-        double x0, y0;
-        double x, y;
+        const double row_u[8] = { x, y, 1., 0., 0., 0., -x * u, -y * u };
+        const double row_v[8] = { 0., 0., 0., x, y, 1., -x * v, -y * v };
 
-        // x0 = matches[i].xl; 
-        // y0 = matches[i].yl;
+        std::copy(row_u, row_u + 8, A[2 * k]);
+        std::copy(row_v, row_v + 8, A[2 * k + 1]);
+        b[2 * k]     = u;
+        b[2 * k + 1] = v;
+    }
 
-        x0 = keypoints_left[matches[i].queryIdx].pt.x;
-        y0 = keypoints_left[matches[i].queryIdx].pt.y;
+    if (!solve8(A, b, G.h)) {
+        return false;
+    }
+    G.h[8] = 1.;
+    return true;
+}
+
+
+/**
+ * Marks the correspondences whose reprojection error is below the threshold
+ * and counts them. The coordinates are separate arrays and the loop has no
+ * branches, so the compiler vectorizes it.
+ *
+ * @param mask  Output, mask[i] = 1 for an inlier, 0 otherwise
+ */
+static int scoreModel(const Homography& G, const double *xs, const double *ys,
+                      const double *us, const double *vs, const int n,
+                      const double threshold2, unsigned char *mask)
+{
+    const double *g = G.h;
+    int count = 0;
+
+    for (int i = 0; i < n; i++) {
+        const double w  = 1. / (g[6] * xs[i] + g[7] * ys[i] + g[8]);
+        const double dx = (g[0] * xs[i] + g[1] * ys[i] + g[2]) * w - us[i];
+        const double dy = (g[3] * xs[i] + g[4] * ys[i] + g[5]) * w - vs[i];
+
+        mask[i] = (dx * dx + dy * dy < threshold2);
+        count += mask[i];
+    }
+    return count;
+}
+
+
+/**
+ * Robust estimate of the homography that maps src[i] onto dst[i] by PROSAC.
+ *
+ * The correspondences have to be ordered by quality, best first (e.g. by
+ * DMatch::distance). The minimal samples are drawn from a pool of the best
+ * correspondences that grows with the iterations, so good hypotheses are found
+ * early. The iteration count adapts to the inlier ratio of the best hypothesis
+ * and the search stops as soon as RANSAC_CONFIDENCE is reached. The best
+ * hypothesis is refined on its inliers by Gauss-Newton steps.
+ *
+ * @param src
+ * @param dst
+ * @param threshold  maximum reprojection error of an inlier in pixels
+ * @param inliers    Output, inliers[i] = 1 if correspondence i is an inlier
+ */
+Homography findHomographyRansac(const vector<Point2d>& src, const vector<Point2d>& dst,
+                                const double threshold, vector<unsigned char>& inliers)
+{
+    const int n = src.size();
+    inliers.assign(n, 0);
+
+    if (n < 4) {
+        return Homography();
+    }
+
+    // normalized coordinates as structure of arrays
+    const Homography Ts = normalization(&src[0], n);
+    const Homography Td = normalization(&dst[0], n);
+
+    vector<double> coords(4 * n);
+    double *xs = &coords[0];
+    double *ys = xs + n;
+    double *us = ys + n;
+    double *vs = us + n;
+
+    for (int i = 0; i < n; i++) {
+        Ts.apply(src[i].x, src[i].y, &xs[i], &ys[i]);
+        Td.apply(dst[i].x, dst[i].y, &us[i], &vs[i]);
+    }
 
-        ht(x0, y0, H, &x, &y);
+    // Td is a similarity, h[0] is its scale
+    const double threshold2 = threshold * threshold * Td.h[0] * Td.h[0];
 
-        x = (x + x0) / 2.;
-        y = (y + y0) / 2.;
+    vector<unsigned char> mask(n);
+    Homography best;
+    int best_count = 0;
+    double max_iterations = RANSAC_MAX_ITERATIONS;
 
-        points_left.push_back(Point2d(x0, y0));
-        points_right.push_back(Point2d(x, y));
+    // PROSAC growth function (Chum and Matas 2005): after Tn_prime
+    // iterations the pool is extended by the next correspondence
+    int pool = 4;
+    double Tn = RANSAC_MAX_ITERATIONS;
+    for (int i = 0; i < 4; i++) {
+        Tn *= (double) (4 - i) / (n - i);
     }
+    double Tn_prime = 1.;
 
-    Hl = findHomography(points_left, points_right, CV_RANSAC);
+    minstd_rand rng(RANSAC_SEED);
+
+    for (int t = 1; t <= max_iterations; t++) {
+        if (t > Tn_prime && pool < n) {
+            const double Tn1 = Tn * (pool + 1) / (pool + 1 - 4);
+            Tn_prime += ceil(Tn1 - Tn);
+            Tn = Tn1;
+            pool++;
+        }
+
+        // the newest correspondence of the pool is part of every sample until
+        // the pool is extended the next time
+        int sample[4];
+        int drawn = 0;
+        int range = pool;
+
+        if (t <= Tn_prime) {
+            sample[drawn++] = pool - 1;
+            range = pool - 1;
+        }
+        while (drawn < 4) {
+            const int k = rng() % range;
+            if (std::find(sample, sample + drawn, k) == sample + drawn) {
+                sample[drawn++] = k;
+            }
+        }
+
+        Homography G;
+        if (!solveMinimal(xs, ys, us, vs, sample, G)) {
+            continue;
+        }
+
+        const int count = scoreModel(G, xs, ys, us, vs, n, threshold2, &mask[0]);
+        if (count <= best_count) {
+            continue;
+        }
+
+        best = G;
+        best_count = count;
+        inliers.swap(mask);
+
+        // adaptive iteration count
+        const double p_good = pow((double) count / n, 4);
+        if (p_good >= 1.) {
+            break;
+        }
+        max_iterations = std::min((double) RANSAC_MAX_ITERATIONS,
+                                  log(1. - RANSAC_CONFIDENCE) / log(1. - p_good));
+    }
+
+    Homography H = Td.inv() * best * Ts;
+
+    if (best_count < 4) {
+        return H;
+    }
+
+    // refine on the inliers and keep the refinement if it explains at least
+    // as many correspondences
+    vector<Point2d> src_inliers(best_count);
+    vector<Point2d> dst_inliers(best_count);
+
+    for (int i = 0, m = 0; i < n; i++) {
+        if (inliers[i]) {
+            src_inliers[m]   = src[i];
+            dst_inliers[m++] = dst[i];
+        }
+    }
+
+    Homography refined = H;
+    refineHomography(&src_inliers[0], &dst_inliers[0], best_count, refined, GAUSS_NEWTON_STEPS);
+
+    if (scoreModel(Td * refined * Ts.inv(), xs, ys, us, vs, n, threshold2, &mask[0]) >= best_count) {
+        inliers.swap(mask);
+        return refined;
+    }
+    return H;
+}
+
+
+/**
+ * Pixel positions of the matched keypoints, ordered by the distance of the
+ * matches, best first
+ */
+static void matchedPoints(const vector<KeyPoint>& keypoints_a, const vector<KeyPoint>& keypoints_b,
+                          const vector<DMatch>& matches, vector<Point2d>& points_a, vector<Point2d>& points_b)
+{
+    const int n = matches.size();
+
+    vector<int> order(n);
+    for (int i = 0; i < n; i++) {
+        order[i] = i;
+    }
+    stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return matches[a].distance < matches[b].distance;
+    });
+
+    points_a.resize(n);
+    points_b.resize(n);
+
+    for (int i = 0; i < n; i++) {
+        points_a[i] = keypoints_a[matches[order[i]].queryIdx].pt;
+        points_b[i] = keypoints_b[matches[order[i]].trainIdx].pt;
+    }
+}
+
+
+/**
+ * Estimates two homographies that map the left and the right image onto the
+ * plane in the middle between both images.
+ *
+ * A single RANSAC on the left -> right homography (findHomographyRansac())
+ * selects the inliers. Hl is fitted to the midpoints between the left points
+ * and their transformation, Hr starts as Hl * H^-1. Both are refined
+ * alternately by Gauss-Newton steps, each one onto the points transformed by
+ * the other. The point buffers are allocated once.
+ */
+void findHomographyLR(const vector<KeyPoint>& keypoints_left, const vector<KeyPoint>& keypoints_right,
+                      const vector<DMatch>& matches, Homography& Hl, Homography& Hr)
+{
+    vector<Point2d> points_left;
+    vector<Point2d> points_right;
+    matchedPoints(keypoints_left, keypoints_right, matches, points_left, points_right);
+
+    const int n = points_left.size();
+    vector<Point2d> targets(n);
+
+    // find "usual" hopmgraphy: left->right
+    vector<unsigned char> inliers;
+    Homography H = findHomographyRansac(points_left, points_right, RANSAC_THRESHOLD, inliers);
+
+    // move the inliers to the front of the buffers. Without enough inliers
+    // all matches are used.
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+        if (inliers[i]) {
+            points_left[m]  = points_left[i];
+            points_right[m] = points_right[i];
+            m++;
+        }
+    }
+    if (m < 4) {
+        matchedPoints(keypoints_left, keypoints_right, matches, points_left, points_right);
+        m = n;
+    }
+
+    // the "middle one": left points onto the midpoints
+    for (int i = 0; i < m; i++) {
+        const Point2d p = H(points_left[i]);
+        targets[i] = Point2d((p.x + points_left[i].x) / 2., (p.y + points_left[i].y) / 2.);
+    }
+    Hl = Homography();
+    refineHomography(&points_left[0], &targets[0], m, Hl, 2 * GAUSS_NEWTON_STEPS);
+
+    // right -> left -> middle
+    Hr = Hl * H.inv();
 
     // iterate
-    for (int it = 0; it < 4; it++) {
-        // transform the left points and keep the right ones
-        points_left.clear();
-        points_right.clear();
-        for (int i = 0 ; i < matches.size(); i++) {
-            double x, y;
-
-            ht(
-                keypoints_left[matches[i].queryIdx].pt.x,
-                keypoints_left[matches[i].queryIdx].pt.y,
-                Hl, &x, &y
-            );
-
-            points_left.push_back(Point2d(x, y));
-            points_right.push_back(keypoints_right[matches[i].trainIdx].pt);
-        }
-        // find the right homography
-        Hr = findHomography(points_right, points_left, CV_RANSAC);
-
-        // transform the right points and keep the left ones
-        points_left.clear();
-        points_right.clear();
-        for (int i = 0 ; i < matches.size(); i++) {
-            double x, y;
-
-            ht(
-                keypoints_right[matches[i].trainIdx].pt.x,
-                keypoints_right[matches[i].trainIdx].pt.y,
-                Hr, &x, &y
-            );
-
-            points_left.push_back(Point2d(keypoints_left[matches[i].queryIdx].pt.x, keypoints_left[matches[i].queryIdx].pt.y));
-            points_right.push_back(Point2d(x, y));
-        }
-        // find the right homography
-        Hl = findHomography(points_left, points_right, CV_RANSAC);
-    }
-}
\ No newline at end of file
+    for (int it = 0; it < JOINT_ITERATIONS; it++) {
+        // the right points onto the transformed left points
+        Hl.transform(&points_left[0], &targets[0], m);
+        refineHomography(&points_right[0], &targets[0], m, Hr, GAUSS_NEWTON_STEPS);
+
+        // the left points onto the transformed right points
+        Hr.transform(&points_right[0], &targets[0], m);
+        refineHomography(&points_left[0], &targets[0], m, Hl, GAUSS_NEWTON_STEPS);
+    }
+}
+
+
+/**
+ * Estimates the homography that maps the keypoints of image a onto their
+ * matches in image b
+ */
+Homography findHomographyPair(const vector<KeyPoint>& keypoints_a, const vector<KeyPoint>& keypoints_b,
+                              const vector<DMatch>& matches)
+{
+    vector<Point2d> points_a;
+    vector<Point2d> points_b;
+    matchedPoints(keypoints_a, keypoints_b, matches, points_a, points_b);
+
+    vector<unsigned char> inliers;
+    return findHomographyRansac(points_a, points_b, RANSAC_THRESHOLD, inliers);
+}
+
+
+/**
+ * Chains the homographies between adjacent images of a sequence into the frame
+ * of a reference image
+ *
+ * @param pairwise      pairwise[i] maps image i onto image i + 1
+ * @param reference     index of the reference image
+ * @param homographies  Output, homographies[i] maps image i onto the reference image
+ */
+void chainHomographies(const vector<Homography>& pairwise, const int reference,
+                       vector<Homography>& homographies)
+{
+    homographies.assign(pairwise.size() + 1, Homography());
+
+    // images before the reference: i -> i + 1 -> ... -> reference
+    for (int i = reference - 1; i >= 0; i--) {
+        homographies[i] = homographies[i + 1] * pairwise[i];
+    }
+
+    // images after the reference: i -> i - 1 -> ... -> reference
+    for (int i = reference + 1; i < homographies.size(); i++) {
+        homographies[i] = homographies[i - 1] * pairwise[i - 1].inv();
+    }
+}
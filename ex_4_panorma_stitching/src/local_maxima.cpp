@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <iostream>
-#include <set>
+#include <algorithm>
+#include <cmath>
 
 #include "panorama.hpp"
 
@@ -8,19 +9,59 @@ using namespace std;
 using namespace cv;
 
 
-ostream& operator<<(ostream& os, const multiset<float>& set)
+/**
+ * Sliding maximum over the windows [col - radius, col + radius] of a row. The
+ * window is clipped at the borders.
+ *
+ * A monotonic deque keeps the indices of strictly decreasing values. Every
+ * index is pushed and popped at most once, so the costs are O(1) per pixel
+ * regardless of the radius.
+ *
+ * @param in      input row
+ * @param out     output row, the sliding maximum
+ * @param n       width of the row
+ * @param radius
+ * @param deque   buffer of at least n elements
+ */
+static void slidingMax(const float *in, float *out, int n, int radius, int *deque)
 {
-    for (multiset<float>::iterator i = set.begin(); i != set.end(); ++i) {
-        os << (*i) << " ";
-    }
+    int head = 0; // front of the deque: index of the maximum in the window
+    int tail = 0; // one past the back of the deque
+
+    for (int i = 0; i < n + radius; i++) {
+        // push the element that enters the window
+        if (i < n) {
+            while (tail > head && in[deque[tail - 1]] <= in[i]) {
+                tail--;
+            }
+            deque[tail++] = i;
+        }
 
-    return os;
+        const int col = i - radius;
+        if (col < 0) {
+            continue;
+        }
+
+        // pop the elements that left the window
+        while (deque[head] < col - radius) {
+            head++;
+        }
+        out[col] = in[deque[head]];
+    }
 }
 
 
 /**
  * Search for local maxima in a vector of keypoints and remove non-maximum keypoints
- * 
+ *
+ * A keypoint is kept if no other keypoint in the (2 * radius + 1)^2 window
+ * around it has a higher response.
+ *
+ * The separable maximum filter only runs over the rows that contain keypoints.
+ * The horizontal maxima of the last 2 * radius + 1 rows are kept in a ring
+ * buffer and the vertical maximum is only evaluated at the keypoints. No full
+ * resolution image is allocated.
+ *
  * @param width     width of the image
  * @param height    height of the image
  * @param keypoints
@@ -28,88 +69,154 @@ ostream& operator<<(ostream& os, const multiset<float>& set)
  */
 void suppressNonMax(int width, int height, std::vector<cv::KeyPoint>& keypoints, int radius)
 {
-    // create a matrix of the qualities
-    Mat responses = Mat::zeros(width, height, CV_32FC1);
+    const int n = keypoints.size();
+    const int window = 2 * radius + 1;
+
+    // pixel positions of the keypoints
+    vector<int> xs(n);
+    vector<int> ys(n);
 
-    // prefill quality matrix
-    for (int i = 0; i < keypoints.size(); i++) {
-        responses.at<float>(keypoints[i].pt) = keypoints[i].response;
+    for (int i = 0; i < n; i++) {
+        xs[i] = std::min(std::max(cvRound(keypoints[i].pt.x), 0), width  - 1);
+        ys[i] = std::min(std::max(cvRound(keypoints[i].pt.y), 0), height - 1);
     }
 
-    // separable maximum filter
-    // 
-    Mat hmax = Mat(width, height, CV_32FC1);
-    Mat vmax = Mat(width, height, CV_32FC1);
-
-    // Use multiset as max heap (std::multiheap keeps its element in a strict
-    // week ordering).
-    // set.rbegin() returns a pointer to the maxial element in the heap
-    multiset<float> set;
-
-    // horizontal
-    // 
-    for (int row = 0; row < height; row++) {
-        set.clear();
-
-        // prefill the multiset with values of pixels that have no
-        // left neighbor
-        for (int col = 0; col < radius; col++) {
-            set.insert(responses.at<float>(row, col));
-        }
+    // keypoints in row major order
+    vector<int> order(n);
+    for (int i = 0; i < n; i++) {
+        order[i] = i;
+    }
+    sort(order.begin(), order.end(), [&](int a, int b) { return ys[a] < ys[b]; });
+
+    // responses of a single row
+    vector<float> responses(width, 0.f);
+    vector<int> deque(width);
+
+    // ring buffer with the horizontal maxima of the rows, row y is stored in
+    // slot y % window
+    vector<float> hmax(window * width);
+    vector<int> slot_row(window, -1);
 
-        // left border
-        for (int col = 0; col < radius + 1; col++) {
-            // insert next right element in scope
-            set.insert(responses.at<float>(row, col + radius));
-            // write local maximum in the row
-            hmax.at<float>(row, col) = *(set.rbegin());
+    vector<bool> keep(n, false);
+
+    // next keypoint whose row has not been filtered yet
+    int next = 0;
+
+    for (int begin = 0; begin < n; ) {
+        const int y = ys[order[begin]];
+
+        // keypoints of the current row
+        int end = begin;
+        while (end < n && ys[order[end]] == y) {
+            end++;
         }
 
-        // inside
-        for (int col = radius + 1; col < width - radius; col++) {
-            // delete first element that is out of scope
-            set.erase(set.find(responses.at<float>(row, col - radius - 1)));
-            set.insert(responses.at<float>(row, col + radius));
-            hmax.at<float>(row, col) = *(set.rbegin());
+        // horizontal pass for all rows that reach into the window of this row
+        while (next < n && ys[order[next]] <= y + radius) {
+            const int row = ys[order[next]];
+
+            int row_end = next;
+            for (; row_end < n && ys[order[row_end]] == row; row_end++) {
+                const int k = order[row_end];
+                responses[xs[k]] = std::max(responses[xs[k]], keypoints[k].response);
+            }
+
+            const int slot = row % window;
+            slidingMax(&responses[0], &hmax[slot * width], width, radius, &deque[0]);
+            slot_row[slot] = row;
+
+            // reset the row for the next one
+            for (; next < row_end; next++) {
+                responses[xs[order[next]]] = 0.f;
+            }
         }
 
-        // right border
-        // we cannot insert right neighbors anymore
-        for (int col = width - radius; col < width; col++) {
-            set.erase(set.find(responses.at<float>(row, col - radius - 1)));
-            hmax.at<float>(row, col) = *(set.rbegin());
+        // vertical pass at the keypoints. Rows without keypoints have a
+        // maximum of zero.
+        for (int i = begin; i < end; i++) {
+            const int k = order[i];
+            float vmax = 0.f;
+
+            for (int row = std::max(y - radius, 0); row <= y + radius; row++) {
+                const int slot = row % window;
+                if (slot_row[slot] == row) {
+                    vmax = std::max(vmax, hmax[slot * width + xs[k]]);
+                }
+            }
+            keep[k] = keypoints[k].response >= vmax;
         }
+
+        begin = end;
     }
 
-    // vertical
-    // 
-    // the same as for the horizontal run, but use the already
-    // computed hmax matrix as input
-    for (int col = 0; col < width; col++) {
-        set.clear();
+    // index pointing to the last element in the
+    // vector that must kept
+    int j = 0;
 
-        // prefill the multiset
-        for (int row = 0; row < radius; row++) {
-            set.insert(hmax.at<float>(row, col));
+    // Remove all non-maximum elements
+    for (int i = 0; i < n; i++) {
+        if (keep[i]) {
+            keypoints[j++] = keypoints[i];
         }
+    }
 
-        // top border
-        for (int row = 0; row < radius + 1; row++) {
-            set.insert(hmax.at<float>(row + radius, col));
-            vmax.at<float>(row, col) = *(set.rbegin());
-        }
+    keypoints.resize(j);
+}
 
-        // inside
-        for (int row = radius + 1; row < height - radius; row++) {
-            set.erase(set.find(hmax.at<float>(row - radius - 1, col)));
-            set.insert(hmax.at<float>(row + radius, col));
-            vmax.at<float>(row, col) = *(set.rbegin());
-        }
 
-        // bottom border
-        for (int row = height - radius; row < height; row++) {
-            set.erase(set.find(hmax.at<float>(row - radius - 1, col)));
-            vmax.at<float>(row, col) = *(set.rbegin());
+/**
+ * Search for local maxima in a vector of keypoints and remove non-maximum keypoints
+ *
+ * Same result as suppressNonMax(), but the keypoints are bucketed into a grid
+ * and every keypoint is only compared with the keypoints of the 3x3
+ * neighbouring cells. The cells are at least radius wide, and wide enough that
+ * there are not more cells than keypoints. Time and memory are O(K) for K
+ * keypoints with bounded density, independent of the image resolution.
+ *
+ * @param width     width of the image
+ * @param height    height of the image
+ * @param keypoints
+ * @param radius    radius of the windows in which non-maximum keypoints are suppressed
+ */
+void suppressNonMaxGrid(int width, int height, std::vector<cv::KeyPoint>& keypoints, int radius)
+{
+    const int n = keypoints.size();
+    if (n == 0) {
+        return;
+    }
+
+    const int cell = std::max(std::max(radius, 1), (int) ceil(sqrt((double) width * height / n)));
+    const int cols = (width  + cell - 1) / cell;
+    const int rows = (height + cell - 1) / cell;
+
+    // pixel positions and cells of the keypoints
+    vector<int> xs(n);
+    vector<int> ys(n);
+    vector<int> cells(n);
+    vector<float> responses(n);
+
+    for (int i = 0; i < n; i++) {
+        xs[i] = std::min(std::max(cvRound(keypoints[i].pt.x), 0), width  - 1);
+        ys[i] = std::min(std::max(cvRound(keypoints[i].pt.y), 0), height - 1);
+        cells[i] = (ys[i] / cell) * cols + xs[i] / cell;
+        responses[i] = keypoints[i].response;
+    }
+
+    // counting sort of the keypoints by cell: the keypoints of cell c are
+    // members[cell_begin[c]], ..., members[cell_begin[c + 1] - 1]
+    vector<int> cell_begin(rows * cols + 1, 0);
+    vector<int> members(n);
+
+    for (int i = 0; i < n; i++) {
+        cell_begin[cells[i] + 1]++;
+    }
+    for (int c = 0; c < rows * cols; c++) {
+        cell_begin[c + 1] += cell_begin[c];
+    }
+    {
+        vector<int> fill(cell_begin.begin(), cell_begin.end() - 1);
+        for (int i = 0; i < n; i++) {
+            members[fill[cells[i]]++] = i;
         }
     }
 
@@ -117,12 +224,32 @@ void suppressNonMax(int width, int height, std::vector<cv::KeyPoint>& keypoints,
     // vector that must kept
     int j = 0;
 
-    // Remove all non-maximum elements
-    for (int i = 0; i < keypoints.size(); i++) {
-        if (vmax.at<float>(keypoints[i].pt) == keypoints[i].response) {
+    for (int i = 0; i < n; i++) {
+        const int cx = xs[i] / cell;
+        const int cy = ys[i] / cell;
+        bool maximum = true;
+
+        for (int y = std::max(cy - 1, 0); y <= std::min(cy + 1, rows - 1) && maximum; y++) {
+            for (int x = std::max(cx - 1, 0); x <= std::min(cx + 1, cols - 1) && maximum; x++) {
+                const int c = y * cols + x;
+
+                for (int m = cell_begin[c]; m < cell_begin[c + 1]; m++) {
+                    const int k = members[m];
+
+                    if (responses[k] > responses[i] &&
+                        abs(xs[k] - xs[i]) <= radius &&
+                        abs(ys[k] - ys[i]) <= radius) {
+                        maximum = false;
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (maximum) {
             keypoints[j++] = keypoints[i];
         }
     }
 
     keypoints.resize(j);
-}
\ No newline at end of file
+}
@@ -2,6 +2,11 @@
 #include <tuple>
 #include <iostream>
 #include <queue>
+#include <algorithm>
+#include <thread>
+#include <string.h>  // memcpy()
+#include <stdint.h>  // uint64_t
+#include <cmath>     // isfinite(), sqrt()
 
 #include <opencv2/features2d/features2d.hpp>  // DMatch
 
@@ -12,45 +17,123 @@ using namespace cv;
 
 static const int NOT_ENGAGED = -1;
 
+// rank of a proposer that is not in the preference list of the acceptor
+static const int NOT_LISTED = -1;
+
+// number of strongest keypoints of each image that are matched exhaustively
+// for the coarse homography of the guided matching
+static const int GUIDED_SAMPLES = 500;
+
+// minimal number of inliers of the coarse homography
+static const int GUIDED_MIN_INLIERS = 15;
+
+// maximum reprojection error of an inlier of the coarse homography in pixels
+static const double GUIDED_RANSAC_THRESHOLD = 5.;
+
+// Lowe's ratio threshold of the sample matches
+static const float GUIDED_MAX_RATIO = 0.8f;
+
+
+void PreferenceTable::resize(const int rows, const int k)
+{
+    this->rows = rows;
+    this->k    = k;
+    index.assign(rows * k, -1);
+    distance.assign(rows * k, 0.f);
+}
+
+
+void PreferenceTable::assign(const vector<vector<DMatch>>& table, const int k)
+{
+    resize(table.size(), k);
+
+    for (int i = 0; i < rows; i++) {
+        const int n = std::min((int) table[i].size(), k);
+
+        for (int j = 0; j < n; j++) {
+            index[i * k + j]    = table[i][j].trainIdx;
+            distance[i * k + j] = table[i][j].distance;
+        }
+    }
+}
+
+
 /**
- * Search for a stable marriage between the feature descriptors on the left
- * and right image.
- *
- * @param descriptors_left
- * @param descriptors_right
- * @param matcher           Matcher that is used to find the k nearest neighbors
- *                          for a single feature descriptor
- * @param k                 Count of nearest neighbors that should be used for
- *                          each single feature descriptor
- * @param matches           Output vector with stable marriage DMatches
+ * Rank of a proposer in the preference list of an acceptor, NOT_LISTED if the
+ * proposer is not in the list. The list is a contiguous row of k indices.
  */
-void marriageMatch(const Mat& descriptors_left,
-                   const Mat& descriptors_right,
-                   DescriptorMatcher& matcher,
-                   const int k,
-                   vector<DMatch>& matches)
+static inline int rankOf(const int *list, const int k, const int proposer)
 {
-    vector<vector<DMatch>> acceptor_table;
-    vector<vector<DMatch>> proposor_table;
+    for (int r = 0; r < k; r++) {
+        if (list[r] == proposer) {
+            return r;
+        }
+    }
+    return NOT_LISTED;
+}
 
-    matcher.knnMatch(descriptors_left, descriptors_right, acceptor_table, k);
-    matcher.knnMatch(descriptors_right, descriptors_left, proposor_table, k);
+
+/**
+ * Lowe's ratio of a match: the distance to the matched neighbor (rank r)
+ * divided by the distance to the closest other neighbor of the same row.
+ * A match that is not the nearest neighbor has a ratio >= 1. A row without a
+ * second neighbor can not be verified and gets the ratio 1 as well, so the
+ * ratio test rejects it.
+ */
+static inline float matchRatio(const PreferenceTable& table, const int row, const int r)
+{
+    const int other = (r == 0) ? 1 : 0;
+
+    if (other >= table.k || table.index[row * table.k + other] < 0) {
+        return 1.f;
+    }
+
+    const float distance = table.distance[row * table.k + r];
+    const float second   = table.distance[row * table.k + other];
+
+    return (second > 0.f) ? distance / second : 1.f;
+}
+
+
+/**
+ * Search for a stable marriage between the keypoints of the left and right
+ * image, given the preference lists of both sides.
+ *
+ * The rank of the current fiance is stored for every acceptor, so a proposal
+ * only has to look up the rank of the proposer in the contiguous row of the
+ * acceptor.
+ *
+ * @param acceptors  k nearest neighbors on the right image for every left
+ *                   descriptor, ordered by distance
+ * @param proposers  k nearest neighbors on the left image for every right
+ *                   descriptor, ordered by distance
+ * @param matches    Output vector with stable marriage DMatches
+ * @param ratios     Optional output, the ratio test value of every match, see
+ *                   matchRatio()
+ */
+void stableMarriage(const PreferenceTable& acceptors,
+                    const PreferenceTable& proposers,
+                    vector<DMatch>& matches,
+                    vector<float>* ratios)
+{
+    const int k = proposers.k;
 
     // Indicates that acceptor i is currently enganged
-    // to the proposer v[i]
-    vector<int> engagements(acceptor_table.size(), NOT_ENGAGED);
+    // to the proposer engagements[i] with rank engaged_ranks[i]
+    vector<int> engagements(acceptors.rows, NOT_ENGAGED);
+    vector<int> engaged_ranks(acceptors.rows, NOT_LISTED);
 
     // queue of proposers that are not currently engaged
     queue<int> free_proposers;
 
     // mark every proposer as free
-    for (int i = 0; i < proposor_table.size(); i++) {
+    for (int i = 0; i < proposers.rows; i++) {
         free_proposers.push(i);
     }
 
     // next[i] is the index of the accecptor to whom
     // proposer[i] has not yet proposed
-    vector<int> next(proposor_table.size(), 0);
+    vector<int> next(proposers.rows, 0);
 
     while (!free_proposers.empty()) {
         int p = free_proposers.front();
@@ -58,86 +141,680 @@ void marriageMatch(const Mat& descriptors_left,
 
         // Check if there are any further prefered
         // acceptors for this proposer
-        if (next[p] >= proposor_table[p].size()) {
+        if (next[p] >= k || proposers.index[p * k + next[p]] < 0) {
             continue;
         }
 
-        assert(p < proposor_table.size());
-        int a = proposor_table[p][next[p]++].trainIdx;
+        const int a = proposers.index[p * k + next[p]++];
+        const int rank = rankOf(acceptors.row(a), acceptors.k, p);
 
         assert(a < engagements.size());
 
+        // The proposer is not in the preference list of the
+        // acceptor. Therefore the proposer stays free
+        if (rank == NOT_LISTED) {
+            free_proposers.push(p);
+        }
         // if the acceptor has not been engaged yet,
         // the proposal get immediately accepted
-        if (engagements[a] == NOT_ENGAGED) {
-            // It is important to check, if the current propser
-            // is contained in the preference list of the acceptor
-            for (int i = 0; i < acceptor_table[a].size(); i++) {
+        else if (engagements[a] == NOT_ENGAGED) {
+            engagements[a]   = p;
+            engaged_ranks[a] = rank;
+        }
+        // the current proposer has a higher preference
+        // than the fiance
+        else if (rank < engaged_ranks[a]) {
+            free_proposers.push(engagements[a]);
+            engagements[a]   = p;
+            engaged_ranks[a] = rank;
+        }
+        // the fiance has a higher preference
+        // for the acceptor
+        else {
+            free_proposers.push(p);
+        }
+    }
 
-                assert(i < acceptor_table[a].size());
+    // Ensure the matches list is empty
+    matches.clear();
+    if (ratios != NULL) {
+        ratios->clear();
+    }
 
-                if (acceptor_table[a][i].trainIdx == p) {
-                    engagements[a] = p;
-                    break;
-                }
-            }
-            // The proposer was not in the preference list. Therefore
-            // the proposer stays free
-            if (engagements[a] == NOT_ENGAGED) {
-                free_proposers.push(p);
+    for (int a = 0; a < engagements.size(); a++) {
+        if (engagements[a] != NOT_ENGAGED) {
+            const int r = engaged_ranks[a];
+            matches.push_back(DMatch(a, engagements[a], acceptors.distance[a * acceptors.k + r]));
+
+            if (ratios != NULL) {
+                ratios->push_back(matchRatio(acceptors, a, r));
             }
-        } else {
-            // the current fiance of the 
-            int fiance = engagements[a];
+        }
+    }
+}
 
-            for (int i = 0; i < acceptor_table[a].size(); i++) {
-                assert(a == acceptor_table[a][i].queryIdx);
 
-                int preference = acceptor_table[a][i].trainIdx;
+/**
+ * Search for a stable marriage between the feature descriptors on the left
+ * and right image.
+ *
+ * @param descriptors_left
+ * @param descriptors_right
+ * @param matcher           Matcher that is used to find the k nearest neighbors
+ *                          for a single feature descriptor
+ * @param k                 Count of nearest neighbors that should be used for
+ *                          each single feature descriptor
+ * @param matches           Output vector with stable marriage DMatches
+ * @param ratios            Optional output, the ratio test value of every match
+ */
+void marriageMatch(const Mat& descriptors_left,
+                   const Mat& descriptors_right,
+                   DescriptorMatcher& matcher,
+                   const int k,
+                   vector<DMatch>& matches,
+                   vector<float>* ratios)
+{
+    PreferenceTable acceptors;
+    PreferenceTable proposers;
 
-                // the fiance has a higher preference
-                // for the acceptor
-                if (preference == fiance) {
-                    free_proposers.push(p);
-                    break;
-                }
-                // the current proposer has a higher preference
-                // than the fiance
-                else if (preference == p) {
-                    engagements[a] = p;
-                    free_proposers.push(fiance);
-                    break;
-                }
-            }
+    // both directions are searched concurrently, each one with its own matcher
+    Ptr<DescriptorMatcher> reverse_matcher = matcher.clone(true);
+
+    thread reverse([&]() {
+        vector<vector<DMatch>> table;
+        reverse_matcher->knnMatch(descriptors_right, descriptors_left, table, k);
+        proposers.assign(table, k);
+    });
+
+    vector<vector<DMatch>> table;
+    matcher.knnMatch(descriptors_left, descriptors_right, table, k);
+    acceptors.assign(table, k);
+
+    reverse.join();
+
+    stableMarriage(acceptors, proposers, matches, ratios);
+}
+
+
+/**
+ * Hamming distance between two binary descriptors of the given length in
+ * 64 bit words. The popcounts of the words are summed up independently, so
+ * the compiler can use the hardware popcount where it is enabled (-mpopcnt or
+ * a target("popcnt") caller it is inlined into).
+ */
+static inline int hamming(const uint64_t *a, const uint64_t *b, const int words)
+{
+    int distance = 0;
+    for (int i = 0; i < words; i++) {
+        distance += __builtin_popcountll(a[i] ^ b[i]);
+    }
+    return distance;
+}
+
+
+/**
+ * Inserts the neighbor t into a row of the k nearest neighbors, ordered by
+ * distance. found is the number of neighbors in the row so far.
+ */
+static inline void insertNeighbor(int *best, float *distances, int& found, const int k,
+                                  const int t, const float distance)
+{
+    if (found == k && distance >= distances[k - 1]) {
+        return;
+    }
+
+    int i = (found < k) ? found++ : k - 1;
+    for (; i > 0 && distances[i - 1] > distance; i--) {
+        best[i]      = best[i - 1];
+        distances[i] = distances[i - 1];
+    }
+    best[i]      = t;
+    distances[i] = distance;
+}
+
+
+/**
+ * k nearest neighbors of every query row among the train rows. The
+ * descriptors are zero padded 64 bit words.
+ */
+static inline void searchHamming(const uint64_t *query_words, const int query_rows,
+                                 const uint64_t *train_words, const int train_rows, const int words,
+                                 PreferenceTable& table)
+{
+    const int k = table.k;
+
+    for (int q = 0; q < query_rows; q++) {
+        const uint64_t *query = &query_words[q * words];
+        int   *best      = &table.index[q * k];
+        float *distances = &table.distance[q * k];
+        int    found     = 0;
+
+        for (int t = 0; t < train_rows; t++) {
+            const int distance = hamming(query, &train_words[t * words], words);
+            insertNeighbor(best, distances, found, k, t, distance);
         }
     }
+}
 
-    // Ensure the matches list is empty
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+/**
+ * searchHamming() compiled with the popcount instruction. It is only called
+ * if the CPU supports it, so the default build runs on every x86 CPU and
+ * still uses the hardware popcount where it exists.
+ */
+__attribute__((target("popcnt")))
+static void searchHammingPopcnt(const uint64_t *query_words, const int query_rows,
+                                const uint64_t *train_words, const int train_rows, const int words,
+                                PreferenceTable& table)
+{
+    searchHamming(query_words, query_rows, train_words, train_rows, words, table);
+}
+
+static const bool cpu_has_popcnt = __builtin_cpu_supports("popcnt");
+
+#endif
+
+
+/**
+ * Brute-force k nearest neighbor search on binary descriptors (CV_8U rows,
+ * e.g. ORB or BRISK) with the Hamming distance.
+ *
+ * @param query   Descriptors that are searched for
+ * @param train   Descriptors that are searched in
+ * @param table   Output, the k nearest neighbors of every query descriptor,
+ *                ordered by distance
+ * @param k
+ */
+void knnMatchHamming(const Mat& query, const Mat& train, PreferenceTable& table, const int k)
+{
+    assert(query.type() == CV_8U && train.type() == CV_8U && query.cols == train.cols);
+
+    // copy the descriptors into zero padded 64 bit words
+    const int words = (query.cols + 7) / 8;
+
+    vector<uint64_t> train_words(train.rows * words, 0);
+    for (int i = 0; i < train.rows; i++) {
+        memcpy(&train_words[i * words], train.ptr(i), train.cols);
+    }
+
+    vector<uint64_t> query_words(query.rows * words, 0);
+    for (int i = 0; i < query.rows; i++) {
+        memcpy(&query_words[i * words], query.ptr(i), query.cols);
+    }
+
+    table.resize(query.rows, k);
+    if (query.rows == 0 || train.rows == 0) {
+        return;
+    }
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    if (cpu_has_popcnt) {
+        searchHammingPopcnt(&query_words[0], query.rows, &train_words[0], train.rows, words, table);
+        return;
+    }
+#endif
+    searchHamming(&query_words[0], query.rows, &train_words[0], train.rows, words, table);
+}
+
+/**
+ * Search for a stable marriage between binary feature descriptors on the left
+ * and right image. The k nearest neighbors are found by a brute-force
+ * Hamming matcher, see knnMatchHamming().
+ *
+ * @param descriptors_left
+ * @param descriptors_right
+ * @param k                 Count of nearest neighbors that should be used for
+ *                          each single feature descriptor
+ * @param matches           Output vector with stable marriage DMatches
+ * @param ratios            Optional output, the ratio test value of every match
+ */
+void marriageMatchHamming(const Mat& descriptors_left,
+                          const Mat& descriptors_right,
+                          const int k,
+                          vector<DMatch>& matches,
+                          vector<float>* ratios)
+{
+    PreferenceTable acceptors;
+    PreferenceTable proposers;
+
+    // both directions are searched concurrently
+    thread reverse([&]() {
+        knnMatchHamming(descriptors_right, descriptors_left, proposers, k);
+    });
+    knnMatchHamming(descriptors_left, descriptors_right, acceptors, k);
+
+    reverse.join();
+
+    stableMarriage(acceptors, proposers, matches, ratios);
+}
+
+
+/**
+ * Lowe's ratio test: removes the matches whose distance is not clearly lower
+ * than the distance to the second nearest neighbor.
+ *
+ * @param ratios     Ratio of every match, see stableMarriage()
+ * @param max_ratio  Matches with a higher ratio are removed
+ * @param matches
+ */
+void ratioTest(const vector<float>& ratios, const float max_ratio, vector<DMatch>& matches)
+{
+    assert(ratios.size() == matches.size());
+
+    int j = 0;
+    for (int i = 0; i < matches.size(); i++) {
+        if (ratios[i] <= max_ratio) {
+            matches[j++] = matches[i];
+        }
+    }
+    matches.resize(j);
+}
+
+
+static bool lowerDistance(const DMatch& a, const DMatch& b)
+{
+    return a.distance < b.distance;
+}
+
+
+/**
+ * Keeps the count matches with the lowest distance. The matches are
+ * partitioned by nth_element() in O(n) instead of sorted, their order is
+ * unspecified afterwards.
+ */
+void selectBestMatches(const int count, vector<DMatch>& matches)
+{
+    if (count <= 0 || count >= matches.size()) {
+        return;
+    }
+
+    nth_element(matches.begin(), matches.begin() + count, matches.end(), lowerDistance);
+    matches.resize(count);
+}
+
+
+/**
+ * Spatial binning of the matches for an even coverage of the image: the left
+ * image is divided into bins x bins cells and every cell keeps its best
+ * matches, at most count / bins^2 of them.
+ *
+ * @param keypoints  Keypoints of the left image (query index of the matches)
+ * @param size       Size of the left image
+ * @param bins       Number of cells in each direction
+ * @param count      Number of matches that is distributed over the cells,
+ *                   0 for the number of matches
+ * @param matches
+ */
+void binMatches(const vector<KeyPoint>& keypoints, const Size& size, const int bins, const int count,
+                vector<DMatch>& matches)
+{
+    if (bins <= 0 || matches.empty()) {
+        return;
+    }
+
+    const int cells    = bins * bins;
+    const int total    = (count > 0) ? std::min(count, (int) matches.size()) : matches.size();
+    const int per_cell = std::max(1, (total + cells - 1) / cells);
+
+    // counting sort of the matches into the cells
+    vector<int> cell(matches.size());
+    vector<int> offsets(cells + 1, 0);
+
+    for (int i = 0; i < matches.size(); i++) {
+        const Point2f& pt = keypoints[matches[i].queryIdx].pt;
+        const int x = std::min(std::max((int) (pt.x * bins / size.width), 0), bins - 1);
+        const int y = std::min(std::max((int) (pt.y * bins / size.height), 0), bins - 1);
+
+        cell[i] = y * bins + x;
+        offsets[cell[i] + 1]++;
+    }
+    for (int c = 0; c < cells; c++) {
+        offsets[c + 1] += offsets[c];
+    }
+
+    vector<DMatch> sorted(matches.size());
+    vector<int> next(offsets.begin(), offsets.end() - 1);
+
+    for (int i = 0; i < matches.size(); i++) {
+        sorted[next[cell[i]]++] = matches[i];
+    }
+
+    // best matches of every cell
     matches.clear();
 
-    for (int i = 0; i < engagements.size(); i++) {
-        if (engagements[i] != NOT_ENGAGED) {
-            // cout << engagements[i] << endl;
+    for (int c = 0; c < cells; c++) {
+        const vector<DMatch>::iterator begin = sorted.begin() + offsets[c];
+        const vector<DMatch>::iterator end   = sorted.begin() + offsets[c + 1];
+
+        if (end - begin > per_cell) {
+            nth_element(begin, begin + per_cell, end, lowerDistance);
+            matches.insert(matches.end(), begin, begin + per_cell);
+        } else {
+            matches.insert(matches.end(), begin, end);
+        }
+    }
+}
+
+
+/**
+ * Distance between a left and a right descriptor: the Hamming distance for
+ * binary descriptors (CV_8U), the Euclidean distance for float descriptors
+ * (CV_32F). This is the scale of the distances of knnMatchHamming() and of the
+ * FLANN matcher, so the filters of the matches work on both paths.
+ */
+class DescriptorDistance
+{
+public:
+    DescriptorDistance(const Mat& left, const Mat& right)
+        : left(left), right(right), binary(left.type() == CV_8U), words((left.cols + 7) / 8)
+    {
+        if (binary) {
+            toWords(left, left_words);
+            toWords(right, right_words);
+        }
+    }
+
+    inline float operator()(const int l, const int r) const
+    {
+        if (binary) {
+            return hamming(&left_words[l * words], &right_words[r * words], words);
+        }
+
+        const float *a = left.ptr<float>(l);
+        const float *b = right.ptr<float>(r);
+        float distance = 0.f;
+
+        for (int i = 0; i < left.cols; i++) {
+            distance += (a[i] - b[i]) * (a[i] - b[i]);
+        }
+        return std::sqrt(distance);
+    }
 
-            // ensure that the acceptor has this number of
-            // neighbors
-            // if (i < acceptor_table[i].size()) {
+private:
+    // copies the descriptors into zero padded 64 bit words
+    void toWords(const Mat& descriptors, vector<uint64_t>& out) const
+    {
+        out.assign(descriptors.rows * words, 0);
+        for (int i = 0; i < descriptors.rows; i++) {
+            memcpy(&out[i * words], descriptors.ptr(i), descriptors.cols);
+        }
+    }
+
+    const Mat& left;
+    const Mat& right;
+    const bool binary;
+    const int  words;
+    vector<uint64_t> left_words;
+    vector<uint64_t> right_words;
+};
+
+
+/**
+ * Keypoints bucketed into square cells, so the keypoints around a position
+ * are found without looking at all keypoints.
+ */
+class KeypointGrid
+{
+public:
+    KeypointGrid(const vector<KeyPoint>& keypoints, const float cell)
+        : keypoints(keypoints), cell(cell), origin(0.f, 0.f), cols(1), rows(1)
+    {
+        // bounding box of the keypoints
+        if (!keypoints.empty()) {
+            Point2f max = keypoints[0].pt;
+            origin = keypoints[0].pt;
+
+            for (int i = 1; i < keypoints.size(); i++) {
+                origin.x = std::min(origin.x, keypoints[i].pt.x);
+                origin.y = std::min(origin.y, keypoints[i].pt.y);
+                max.x    = std::max(max.x, keypoints[i].pt.x);
+                max.y    = std::max(max.y, keypoints[i].pt.y);
+            }
+            cols = (int) ((max.x - origin.x) / cell) + 1;
+            rows = (int) ((max.y - origin.y) / cell) + 1;
+        }
+
+        // counting sort of the keypoints into the cells
+        offsets.assign(cols * rows + 1, 0);
+        for (int i = 0; i < keypoints.size(); i++) {
+            offsets[cellOf(keypoints[i].pt) + 1]++;
+        }
+        for (int c = 0; c < cols * rows; c++) {
+            offsets[c + 1] += offsets[c];
+        }
+
+        indices.resize(keypoints.size());
+        vector<int> next(offsets.begin(), offsets.end() - 1);
+
+        for (int i = 0; i < keypoints.size(); i++) {
+            indices[next[cellOf(keypoints[i].pt)]++] = i;
+        }
+    }
 
-                assert(i < acceptor_table.size());
+    /**
+     * Calls visit(i) for every keypoint i within the radius around (x, y).
+     */
+    template <typename Visit>
+    void around(const double x, const double y, const double radius, Visit visit) const
+    {
+        const int x0 = std::max((int) floor((x - radius - origin.x) / cell), 0);
+        const int x1 = std::min((int) floor((x + radius - origin.x) / cell), cols - 1);
+        const int y0 = std::max((int) floor((y - radius - origin.y) / cell), 0);
+        const int y1 = std::min((int) floor((y + radius - origin.y) / cell), rows - 1);
 
-                // search for the DMatch where the related
-                // train index (index of the keypoint in the other
-                // image) equals the index of the husband
-                for (int j = 0; j < acceptor_table[i].size(); j++) {
+        for (int cy = y0; cy <= y1; cy++) {
+            for (int cx = x0; cx <= x1; cx++) {
+                const int c = cy * cols + cx;
 
-                    // cout << "  " << acceptor_table[i][j].trainIdx << endl;
+                for (int j = offsets[c]; j < offsets[c + 1]; j++) {
+                    const Point2f& pt = keypoints[indices[j]].pt;
+                    const double dx = pt.x - x;
+                    const double dy = pt.y - y;
 
-                    if (acceptor_table[i][j].trainIdx == engagements[i]) {
-                        matches.push_back(acceptor_table[i][j]);
-                        break;
+                    if (dx * dx + dy * dy <= radius * radius) {
+                        visit(indices[j]);
                     }
                 }
-            // }
+            }
+        }
+    }
+
+private:
+    inline int cellOf(const Point2f& pt) const
+    {
+        const int x = std::min(std::max((int) ((pt.x - origin.x) / cell), 0), cols - 1);
+        const int y = std::min(std::max((int) ((pt.y - origin.y) / cell), 0), rows - 1);
+        return y * cols + x;
+    }
+
+    const vector<KeyPoint>& keypoints;
+    const float cell;
+    Point2f origin; // corner of the first cell
+    int cols;
+    int rows;
+    vector<int> offsets; // first entry of every cell in indices
+    vector<int> indices;
+};
+
+
+/**
+ * Indices of the count keypoints with the strongest response
+ */
+static void strongestKeypoints(const vector<KeyPoint>& keypoints, const int count, vector<int>& indices)
+{
+    indices.resize(keypoints.size());
+    for (int i = 0; i < keypoints.size(); i++) {
+        indices[i] = i;
+    }
+
+    if (count < indices.size()) {
+        nth_element(indices.begin(), indices.begin() + count, indices.end(), [&](const int a, const int b) {
+            return keypoints[a].response > keypoints[b].response;
+        });
+        indices.resize(count);
+    }
+}
+
+
+/**
+ * Coarse homography from the left onto the right image. The strongest
+ * keypoints of both images are matched exhaustively (stable marriage and
+ * ratio test) and the homography is estimated by findHomographyRansac().
+ *
+ * @return false if the homography has less than GUIDED_MIN_INLIERS inliers
+ */
+static bool coarseHomography(const vector<KeyPoint>& keypoints_left,
+                             const vector<KeyPoint>& keypoints_right,
+                             const DescriptorDistance& distance,
+                             const int k,
+                             Homography& H)
+{
+    vector<int> samples_left;
+    vector<int> samples_right;
+
+    strongestKeypoints(keypoints_left, GUIDED_SAMPLES, samples_left);
+    strongestKeypoints(keypoints_right, GUIDED_SAMPLES, samples_right);
+
+    // k nearest neighbors among the samples, indices into the sample lists
+    PreferenceTable acceptors;
+    PreferenceTable proposers;
+
+    acceptors.resize(samples_left.size(), k);
+    proposers.resize(samples_right.size(), k);
+
+    for (int l = 0; l < samples_left.size(); l++) {
+        int found = 0;
+        for (int r = 0; r < samples_right.size(); r++) {
+            insertNeighbor(&acceptors.index[l * k], &acceptors.distance[l * k], found, k,
+                           r, distance(samples_left[l], samples_right[r]));
+        }
+    }
+    for (int r = 0; r < samples_right.size(); r++) {
+        int found = 0;
+        for (int l = 0; l < samples_left.size(); l++) {
+            insertNeighbor(&proposers.index[r * k], &proposers.distance[r * k], found, k,
+                           l, distance(samples_left[l], samples_right[r]));
+        }
+    }
+
+    vector<DMatch> matches;
+    vector<float> ratios;
+
+    stableMarriage(acceptors, proposers, matches, &ratios);
+    ratioTest(ratios, GUIDED_MAX_RATIO, matches);
+
+    if (matches.size() < GUIDED_MIN_INLIERS) {
+        return false;
+    }
+
+    // best matches first for PROSAC
+    sort(matches.begin(), matches.end(), [](const DMatch& a, const DMatch& b) {
+        return a.distance < b.distance;
+    });
+
+    vector<Point2d> points_left(matches.size());
+    vector<Point2d> points_right(matches.size());
+
+    for (int i = 0; i < matches.size(); i++) {
+        points_left[i]  = keypoints_left[samples_left[matches[i].queryIdx]].pt;
+        points_right[i] = keypoints_right[samples_right[matches[i].trainIdx]].pt;
+    }
+
+    vector<unsigned char> inliers;
+    H = findHomographyRansac(points_left, points_right, GUIDED_RANSAC_THRESHOLD, inliers);
+
+    int count = 0;
+    for (int i = 0; i < inliers.size(); i++) {
+        count += inliers[i];
+    }
+    return count >= GUIDED_MIN_INLIERS;
+}
+
+
+/**
+ * k nearest neighbors of every query keypoint among the train keypoints
+ * around its position predicted by the homography.
+ *
+ * @param distance  Distance between a query and a train descriptor
+ */
+template <typename Distance>
+static void knnMatchGuided(const vector<KeyPoint>& query, const KeypointGrid& train,
+                           const Homography& H, const double radius, const int k,
+                           Distance distance, PreferenceTable& table)
+{
+    table.resize(query.size(), k);
+
+    for (int q = 0; q < query.size(); q++) {
+        double x, y;
+        H.apply(query[q].pt.x, query[q].pt.y, &x, &y);
+
+        if (!std::isfinite(x) || !std::isfinite(y)) {
+            continue;
         }
+
+        int   *best      = &table.index[q * k];
+        float *distances = &table.distance[q * k];
+        int    found     = 0;
+
+        train.around(x, y, radius, [&](const int t) {
+            insertNeighbor(best, distances, found, k, t, distance(q, t));
+        });
     }
-}
\ No newline at end of file
+}
+
+
+/**
+ * Guided stable marriage matching. A coarse homography is estimated from the
+ * strongest keypoints of both images (see coarseHomography()), afterwards
+ * every descriptor is only compared with the descriptors of the keypoints
+ * around its predicted position in the other image. The keypoints are looked
+ * up in a grid, so the cost drops from O(N * M) towards O(N * c) for c
+ * keypoints in the search radius.
+ *
+ * @param keypoints_left
+ * @param descriptors_left
+ * @param keypoints_right
+ * @param descriptors_right
+ * @param k                 Count of nearest neighbors that should be used for
+ *                          each single feature descriptor
+ * @param radius            Search radius around the predicted position in pixels
+ * @param matches           Output vector with stable marriage DMatches
+ * @param ratios            Optional output, the ratio test value of every match
+ * @return false if no coarse homography was found, matches is unchanged then
+ */
+bool guidedMatch(const vector<KeyPoint>& keypoints_left, const Mat& descriptors_left,
+                 const vector<KeyPoint>& keypoints_right, const Mat& descriptors_right,
+                 const int k, const double radius,
+                 vector<DMatch>& matches, vector<float>* ratios)
+{
+    const DescriptorDistance distance(descriptors_left, descriptors_right);
+
+    Homography H;
+    if (!coarseHomography(keypoints_left, keypoints_right, distance, k, H)) {
+        return false;
+    }
+
+    const KeypointGrid grid_left(keypoints_left, radius);
+    const KeypointGrid grid_right(keypoints_right, radius);
+
+    PreferenceTable acceptors;
+    PreferenceTable proposers;
+
+    // both directions are searched concurrently
+    const Homography H_inv = H.inv();
+
+    thread reverse([&]() {
+        knnMatchGuided(keypoints_right, grid_left, H_inv, radius, k, [&](const int r, const int l) {
+            return distance(l, r);
+        }, proposers);
+    });
+    knnMatchGuided(keypoints_left, grid_right, H, radius, k, [&](const int l, const int r) {
+        return distance(l, r);
+    }, acceptors);
+
+    reverse.join();
+
+    stableMarriage(acceptors, proposers, matches, ratios);
+    return true;
+}
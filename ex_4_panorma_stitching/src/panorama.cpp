@@ -4,6 +4,8 @@
 #include <time.h>
 #include <fstream>
 #include <limits>
+#include <getopt.h> // getopt_long()
+#include <chrono>
 
 // openCV
 #include <opencv2/core/core.hpp>
@@ -19,91 +21,376 @@
 using namespace std;
 using namespace cv;
 
-int main(int argc, char **argv)
+static void usage()
+{
+    cout << "Usage: ./panorama [options] <image 1> <image 2> [<image 3> ...]"          << endl
+         << "  The images have to be ordered, adjacent images have to overlap."        << endl
+         << "  options:"                                                               << endl
+         << "    -h, --help        Show this help message"                             << endl
+         << "    -o, --output      Name of the output file. Default: panorama-maxdist.png" << endl
+         << "                      A .ppm output of the inverse renderer is written"   << endl
+         << "                      strip by strip without holding the whole canvas"    << endl
+         << "    -r, --renderer    Renderer for the panorama"                          << endl
+         << "                        Available:"                                       << endl
+         << "                          - inverse (inverse mapping in parallel tiles)"  << endl
+         << "                          - splat   (forward mapping of every pixel)"     << endl
+         << "                          - multiband (Laplacian pyramid blending)"       << endl
+         << "                          - seam    (one image per pixel, cut by seams)"  << endl
+         << "                      Default: inverse"                                   << endl
+         << "    -a, --accumulator Accumulation buffers of the splat renderer"         << endl
+         << "                        Available:"                                       << endl
+         << "                          - double"                                       << endl
+         << "                          - float"                                        << endl
+         << "                          - fixed   (32 bit fixed-point)"                 << endl
+         << "                      Default: float"                                     << endl
+         << "    -d, --descriptor  Feature descriptor"                                 << endl
+         << "                        Available:"                                       << endl
+         << "                          - surf    (64 floats, FLANN matcher)"           << endl
+         << "                          - orb     (256 bits, Hamming matcher)"          << endl
+         << "                      Default: surf"                                      << endl
+         << "    -s, --nms         Non-maximum suppression of the keypoints"           << endl
+         << "                        Available:"                                       << endl
+         << "                          - grid    (keypoints bucketed into a grid)"     << endl
+         << "                          - deque   (separable sliding maximum filter)"   << endl
+         << "                      Default: grid"                                      << endl
+         << "    -j, --threads     Number of threads. Default: number of CPU cores"    << endl
+         << "    -c, --cache       Directory of the feature cache. The keypoints and"  << endl
+         << "                      descriptors of every image are stored there and"    << endl
+         << "                      loaded again by later runs. Default: no cache"      << endl
+         << "    -p, --profile     Write the times, counts and memory usage of the"    << endl
+         << "                      stages as JSON report to this file"                 << endl
+         << "    -v, --verbose     Write debug images of the keypoints and matches."   << endl
+         << "                      They are drawn in the background"                   << endl
+         << "    -f, --format      Format of the debug images"                         << endl
+         << "                        Available:"                                       << endl
+         << "                          - png     (lowest compression level)"           << endl
+         << "                          - ppm     (uncompressed PPM / PGM)"             << endl
+         << "                      Default: png"                                       << endl
+         << "    -m, --filter      Filter of the matches"                              << endl
+         << "                        Available:"                                       << endl
+         << "                          - maxdist (threshold relative to best match)"   << endl
+         << "                          - ratio   (Lowe's ratio test)"                  << endl
+         << "                      Default: maxdist"                                   << endl
+         << "    -k, --top         Keep the best N matches of each pair. Default: all" << endl
+         << "    -b, --bins        Keep the best matches in each of N x N cells of"    << endl
+         << "                      the image for an even coverage. Default: off"       << endl
+         << "    -g, --guided      Match around the positions predicted by a coarse"   << endl
+         << "                      homography of the strongest keypoints"              << endl;
+}
+
+
+/**
+ * Name of an image in file names and messages: "L" and "R" for a pair,
+ * the index in the image sequence otherwise
+ */
+static string imageTag(const int i, const int n)
 {
-    if (argc != 3) {
-        cerr << "Usage: ps <left image> <right image>" << endl;
-        return 0;
+    if (n == 2) {
+        return i == 0 ? "L" : "R";
     }
+    return to_string(i);
+}
 
-    // read images
-    Mat img_left = imread(argv[1], CV_LOAD_IMAGE_COLOR);
-    if (img_left.empty()) {
-        cerr << "Can not read " << argv[1] << endl;
-        return 1;
+
+/**
+ * Name of the pair of the images i and i + 1 in the file names of the debug
+ * images: empty for two images, so they keep the names of the original
+ * program (matches.png), "01", "12", ... otherwise
+ */
+static string pairFileTag(const int i, const int n)
+{
+    if (n == 2) {
+        return "";
     }
+    return imageTag(i, n) + imageTag(i + 1, n);
+}
 
-    Mat img_right = imread(argv[2], CV_LOAD_IMAGE_COLOR);
-    if (img_right.empty()) {
-        cerr << "Can not read " << argv[2] << endl;
-        return 1;
+
+// SURF threshold of the keypoint detection
+static const int MIN_HESSIAN = 600;
+
+// maximal number of ORB keypoints in an image
+static const int ORB_FEATURES = 5000;
+
+// Overlap of the bands of the tiled keypoint detection in pixels. It covers
+// the largest SURF filter (195 pixels for 4 octaves) and the ORB border on the
+// coarsest pyramid level (31 * 1.2^7 pixels), so keypoints in the core of a
+// band are found as in the whole image.
+static const int DETECT_MARGIN = 128;
+
+// Height of the bands of the tiled detection and description in pixels. The
+// bands only depend on the image size, not on the number of threads, so the
+// features are the same for every --threads.
+static const int DETECT_BAND_HEIGHT = 4 * DETECT_MARGIN;
+
+// number of nearest neighbors of the stable marriage matching
+static const int MATCH_NEIGHBORS = 10;
+
+// Lowe's threshold on the ratio of the nearest and second nearest distance
+static const float MAX_MATCH_RATIO = 0.8f;
+
+// search radius of the guided matching relative to the image width
+static const double GUIDED_RADIUS = 0.02;
+
+
+/**
+ * Wall clock times of the stages of detectFeatures() in seconds
+ */
+struct FeatureTimes
+{
+    double gray;
+    double detect;
+    double nms;
+    double describe;
+    double cache;  // hashing, loading and storing the cache entry
+    bool   cached; // features loaded from the cache, nothing was detected
+};
+
+
+/**
+ * Detects keypoints with SURF or ORB
+ *
+ * @param max_keypoints Upper bound for the number of ORB keypoints
+ */
+static void detectKeypoints(const string& descriptor, const Mat& gray, const int max_keypoints,
+                            vector<KeyPoint>& keypoints)
+{
+    if (descriptor == "orb") {
+        OrbFeatureDetector detector(max_keypoints);
+        detector.detect(gray, keypoints);
+    } else { // descriptor == "surf"
+        SurfFeatureDetector detector(MIN_HESSIAN);
+        detector.detect(gray, keypoints);
     }
+}
 
-    // Convert to grayscale image
-    Mat gray_left;
-    Mat gray_right;
 
-    cvtColor(img_left,  gray_left,  CV_BGR2GRAY);
-    cvtColor(img_right, gray_right, CV_BGR2GRAY);
+/**
+ * Computes SURF (64 floats) or ORB (32 bytes) descriptors. Keypoints without a
+ * descriptor are removed.
+ */
+static void computeDescriptors(const string& descriptor, const Mat& gray,
+                               vector<KeyPoint>& keypoints, Mat& descriptors)
+{
+    if (descriptor == "orb") {
+        OrbDescriptorExtractor extractor;
+        extractor.compute(gray, keypoints, descriptors);
+    } else { // descriptor == "surf"
+        SurfDescriptorExtractor extractor;
+        extractor.compute(gray, keypoints, descriptors);
+    }
+}
 
 
-    // Feature / keypoint detection
-    // 
-    cout << "Detect keypoints ..." << endl;
+/**
+ * Rows of band b of the tiled detection and description. The core rows of the
+ * bands partition the image, the rows [begin, end) add DETECT_MARGIN above and
+ * below.
+ */
+struct DetectBand
+{
+    int core_begin;
+    int core_end;
+    int begin;
+    int end;
 
-    vector<KeyPoint> keypoints_left, keypoints_right;
+    DetectBand(const int rows, const int band_height, const int b)
+        : core_begin(std::min(b * band_height, rows)),
+          core_end(std::min(core_begin + band_height, rows)),
+          begin(std::max(core_begin - DETECT_MARGIN, 0)),
+          end(std::min(core_end + DETECT_MARGIN, rows))
+    {}
+};
 
-    int minHessian = 600;
-    SurfFeatureDetector detector(minHessian);
 
-    detector.detect(gray_left, keypoints_left);
-    detector.detect(gray_right, keypoints_right);
+static int detectBands(const int rows)
+{
+    return std::max(1, rows / DETECT_BAND_HEIGHT);
+}
+
+
+/**
+ * Detects keypoints in horizontal bands of the image on num_threads threads.
+ * The bands overlap by DETECT_MARGIN, a keypoint is kept by the band whose
+ * core contains it. Every band may find ORB_FEATURES ORB keypoints, the
+ * strongest ORB_FEATURES of all bands are kept.
+ */
+static void detectTiled(const string& descriptor, const Mat& gray, const int num_threads,
+                        vector<KeyPoint>& keypoints)
+{
+    const int bands = detectBands(gray.rows);
+    const int band_height = (gray.rows + bands - 1) / bands;
 
+    vector<vector<KeyPoint>> band_keypoints(bands);
 
-    // non-maximum-suppression
-    // 
-    cout << "Non maximum suppression ..." << endl;
+    parallelFor(bands, num_threads, [&](const int b) {
+        const DetectBand band(gray.rows, band_height, b);
+
+        vector<KeyPoint> found;
+        detectKeypoints(descriptor, gray.rowRange(band.begin, band.end), ORB_FEATURES, found);
+
+        for (int i = 0; i < found.size(); i++) {
+            found[i].pt.y += band.begin;
+            if (found[i].pt.y >= band.core_begin && found[i].pt.y < band.core_end) {
+                band_keypoints[b].push_back(found[i]);
+            }
+        }
+    });
 
-    suppressNonMax(gray_left.cols,  gray_left.rows,  keypoints_left,  gray_left.cols  * 0.01); // TODO parameter for this scaling factor
-    suppressNonMax(gray_right.cols, gray_right.rows, keypoints_right, gray_right.cols * 0.01);
+    keypoints.clear();
+    for (int b = 0; b < bands; b++) {
+        keypoints.insert(keypoints.end(), band_keypoints[b].begin(), band_keypoints[b].end());
+    }
+
+    if (descriptor == "orb") {
+        KeyPointsFilter::retainBest(keypoints, ORB_FEATURES);
+    }
+}
+
+
+/**
+ * Computes the descriptors of the keypoints in the bands of detectTiled() on
+ * num_threads threads. Every band is described on the rows it was detected
+ * on, so the ORB pyramid is only built once per band. The keypoints are
+ * reordered by band. Keypoints without a descriptor are removed, like
+ * DescriptorExtractor::compute() does.
+ */
+static void describeTiled(const string& descriptor, const Mat& gray, const int num_threads,
+                          vector<KeyPoint>& keypoints, Mat& descriptors)
+{
+    const int bands = detectBands(gray.rows);
+    const int band_height = (gray.rows + bands - 1) / bands;
 
-    cout << "  " <<  keypoints_left.size()  << " keypoints left"  << endl
-         << "  " <<  keypoints_right.size() << " keypoints right" << endl;
+    vector<vector<KeyPoint>> band_keypoints(bands);
+    vector<Mat> band_descriptors(bands);
 
-    if (verbose) {
-        save_keypoints_as_image(gray_left,  keypoints_left,  "keypointsL.png");
-        save_keypoints_as_image(gray_right, keypoints_right, "keypointsR.png");
+    for (int i = 0; i < keypoints.size(); i++) {
+        const int b = std::min(std::max(int(keypoints[i].pt.y) / band_height, 0), bands - 1);
+        band_keypoints[b].push_back(keypoints[i]);
     }
 
+    parallelFor(bands, num_threads, [&](const int b) {
+        const DetectBand band(gray.rows, band_height, b);
 
-    // Calculate descriptors (alias feature vectors)
-    // 
-    SurfDescriptorExtractor extractor;
-    Mat descriptors_left, descriptors_right;
+        vector<KeyPoint>& kps = band_keypoints[b];
+        if (kps.empty()) {
+            return;
+        }
+        for (int i = 0; i < kps.size(); i++) {
+            kps[i].pt.y -= band.begin;
+        }
+        computeDescriptors(descriptor, gray.rowRange(band.begin, band.end), kps, band_descriptors[b]);
+        for (int i = 0; i < kps.size(); i++) {
+            kps[i].pt.y += band.begin;
+        }
+    });
 
-    cout << "Compute feature descriptors ..." << endl;
+    keypoints.clear();
+    descriptors = Mat();
+    for (int b = 0; b < bands; b++) {
+        keypoints.insert(keypoints.end(), band_keypoints[b].begin(), band_keypoints[b].end());
+        descriptors.push_back(band_descriptors[b]);
+    }
+}
+
+
+/**
+ * Converts an image to grayscale, detects keypoints, suppresses non-maximum
+ * keypoints and computes the feature descriptors (alias feature vectors) of
+ * the remaining ones
+ *
+ * If the features of the image are in the cache, they are loaded instead.
+ * Otherwise the detected features are stored in the cache.
+ *
+ * @param descriptor  "surf" or "orb"
+ * @param num_threads Number of threads for the detection and description
+ * @param cache       Feature cache, may be disabled
+ * @param tag         Name of the image in the profile
+ * @param times       Output, wall clock times of the single stages
+ */
+static void detectFeatures(const Mat& image, const string& descriptor, const string& nms, const int num_threads,
+                           FeatureCache& cache, Profiler& profiler, const string& tag,
+                           Mat& gray, vector<KeyPoint>& keypoints, Mat& descriptors,
+                           FeatureTimes& times)
+{
+    times = FeatureTimes();
 
-    extractor.compute(gray_left,  keypoints_left,  descriptors_left);
-    extractor.compute(gray_right, keypoints_right, descriptors_right);
+    {
+        ScopedTimer timer(profiler, "gray", tag, &times.gray);
+        cvtColor(image, gray, CV_BGR2GRAY);
+    }
 
-    
-    // Matching
-    // 
-    FlannBasedMatcher matcher;
-    // BFMatcher matcher;  // Brute-Force matcher
-    vector<DMatch> matches;
+    // everything that changes the features is part of the key
+    uint64_t key = 0;
+    if (cache.enabled()) {
+        ScopedTimer timer(profiler, "cache load", tag, &times.cache);
 
-    cout << "Matching ..." << endl;
+        const string parameters = descriptor + " " + nms + " " + to_string(MIN_HESSIAN) + " "
+                                + (descriptor == "orb" ? to_string(ORB_FEATURES) : "");
+        key = FeatureCache::key(image, parameters);
+        times.cached = cache.load(key, keypoints, descriptors);
+        timer.count(times.cached ? keypoints.size() : 0);
+    }
 
-    // The usage of the stable marriage matching does not improve the result panorama
-    // matcher.match(descriptors_left, descriptors_right, matches);
-    marriageMatch(descriptors_left, descriptors_right, matcher, 10, matches);
+    if (times.cached) {
+        return;
+    }
 
-    if (verbose) {
+    {
+        ScopedTimer timer(profiler, "detect", tag, &times.detect);
+        detectTiled(descriptor, gray, num_threads, keypoints);
+        timer.count(keypoints.size());
+    }
+
+    {
+        ScopedTimer timer(profiler, "nms", tag, &times.nms);
+        const int radius = gray.cols * 0.01; // TODO parameter for this scaling factor
+        if (nms == "grid") {
+            suppressNonMaxGrid(gray.cols, gray.rows, keypoints, radius);
+        } else { // nms == "deque"
+            suppressNonMax(gray.cols, gray.rows, keypoints, radius);
+        }
+        timer.count(keypoints.size());
+    }
+
+    {
+        ScopedTimer timer(profiler, "describe", tag, &times.describe);
+        describeTiled(descriptor, gray, num_threads, keypoints, descriptors);
+        timer.count(descriptors.rows);
+    }
+
+    if (cache.enabled()) {
+        double seconds;
+        ScopedTimer timer(profiler, "cache store", tag, &seconds);
+        if (!cache.store(key, keypoints, descriptors)) {
+            cerr << "Can not store the features in the cache" << endl;
+        }
+        times.cache += timer.stop();
+    }
+}
+
+
+/**
+ * Saves the matches between two images as image, if the debug writer is
+ * enabled. The image is drawn and written on the background thread of the
+ * writer, which gets its own copy of the keypoints and matches.
+ */
+static void saveMatches(DebugWriter& debug,
+                        const Mat& gray_a, const vector<KeyPoint>& keypoints_a,
+                        const Mat& gray_b, const vector<KeyPoint>& keypoints_b,
+                        const vector<DMatch>& matches, const string& filename)
+{
+    if (!debug.enabled()) {
+        return;
+    }
+
+    const string format = debug.format();
+
+    debug.submit([=]() {
         Mat img_matches;
         drawMatches(
-            gray_left,  keypoints_left,              // left image with its keypoints
-            gray_right, keypoints_right,             // right image with its keypoints
+            gray_a, keypoints_a,                     // first image with its keypoints
+            gray_b, keypoints_b,                     // second image with its keypoints
             matches,                                 // matches between the keypoints
             img_matches,                             // output image
             Scalar::all(-1),                         // color of matches
@@ -112,74 +399,426 @@ int main(int argc, char **argv)
                                                      // all matches are drawn 
             DrawMatchesFlags::NOT_DRAW_SINGLE_POINTS // Single keypoints will not be drawn
         );
-        imwrite("matches.png", img_matches);
+        writeImage(filename, img_matches, format);
+    });
+}
+
+
+/**
+ * Matches the feature descriptors of two images and removes bad matches
+ *
+ * @param guided   Search the matches only around the positions predicted by a
+ *                 coarse homography, see guidedMatch()
+ * @param filter   Filter of the matches:
+ *                   "maxdist" - distance threshold relative to the best match
+ *                   "ratio"   - Lowe's ratio test
+ * @param top      Number of best matches that are kept, 0 for all
+ * @param bins     Spatial binning of the matches into bins x bins cells of the
+ *                 left image, 0 disables the binning
+ * @param debug    Writer of the debug images
+ * @param file_tag Name of the image pair in the file names of the debug images
+ * @param tag      Name of the image pair in the profile
+ * @param matches  Output vector with the remaining matches
+ */
+static void matchFeatures(const Mat& gray_a, const vector<KeyPoint>& keypoints_a, const Mat& descriptors_a,
+                          const Mat& gray_b, const vector<KeyPoint>& keypoints_b, const Mat& descriptors_b,
+                          const bool guided, const string& filter, const int top, const int bins,
+                          DebugWriter& debug, const string& file_tag, const string& tag, Profiler& profiler,
+                          vector<DMatch>& matches)
+{
+    ScopedTimer match_timer(profiler, "match", tag);
+
+    // binary descriptors (ORB) are matched by their Hamming distance
+    const bool binary = descriptors_a.type() == CV_8U;
+
+    // ratio test values of the matches
+    vector<float> ratios;
+    vector<float>* ratios_out = (filter == "ratio") ? &ratios : NULL;
+
+    // the full matching is the fallback if no coarse homography is found
+    if (!guided || !guidedMatch(keypoints_a, descriptors_a, keypoints_b, descriptors_b, MATCH_NEIGHBORS,
+                                gray_a.cols * GUIDED_RADIUS, matches, ratios_out)) {
+        if (binary) {
+            marriageMatchHamming(descriptors_a, descriptors_b, MATCH_NEIGHBORS, matches, ratios_out);
+        } else {
+            FlannBasedMatcher matcher;
+            // BFMatcher matcher;  // Brute-Force matcher
+
+            // The usage of the stable marriage matching does not improve the result panorama
+            // matcher.match(descriptors_a, descriptors_b, matches);
+            marriageMatch(descriptors_a, descriptors_b, matcher, MATCH_NEIGHBORS, matches, ratios_out);
+        }
     }
 
-    cout << matches.size() << " matches" << endl;
+    match_timer.count(matches.size());
+    match_timer.stop();
+
+    saveMatches(debug, gray_a, keypoints_a, gray_b, keypoints_b, matches, "matches" + file_tag + ".png");
 
     // Apply quality threshold on the matches
     // 
-    double max_dist = 0;
-    double min_dist = numeric_limits<double>::max();
+    ScopedTimer filter_timer(profiler, "filter", tag);
 
-    cout << "Remove bad matches ..." << endl;
+    if (filter == "ratio") {
+        ratioTest(ratios, MAX_MATCH_RATIO, matches);
+    } else { // filter == "maxdist"
+        double min_dist = numeric_limits<double>::max();
 
-    // Quick calculation of max and min distances between keypoints
-    for (int i = 0; i < matches.size(); i++) {
-        double dist = matches[i].distance;
+        // Quick calculation of the min distance between keypoints
+        for (int i = 0; i < matches.size(); i++) {
+            double dist = matches[i].distance;
+
+            if (dist < min_dist) min_dist = dist;
+        }
 
-        if (dist < min_dist) min_dist = dist;
-        if (dist > max_dist) max_dist = dist;
+        // Removes all matches that have a heigher distance than
+        // the configured threshold.
+        int j = 0;
+        for (int i = 0; i < matches.size(); i++) {
+            // We use a constant 0.02 (30 bits for binary descriptors), because
+            // if we have found a nearly perfect match, all other matches would
+            // be removed.
+            if (matches[i].distance <= max(8 * min_dist, binary ? 30. : 0.02)) {
+                matches[j++] = matches[i];
+            }
+        }
+        matches.resize(j);
     }
-  
-    if (verbose){
-        cout << "  Max dist: " << max_dist << endl
-             << "  Min dist: " << min_dist << endl;
+
+    // even coverage of the image, the best matches of every cell
+    if (bins > 0) {
+        binMatches(keypoints_a, gray_a.size(), bins, top, matches);
+    } else {
+        selectBestMatches(top, matches);
     }
-  
-    // Removes all matches that have a heigher distance than
-    // the configured threshold.
-    int j = 0;
-    for (int i = 0; i < matches.size(); i++) {
-        // We use a constant 0.02, because if we have found a nearly 
-        // perfect match, all other matches would be removed.
-        if (matches[i].distance <= max(8 * min_dist, 0.02)) {
-            matches[j++] = matches[i];
+
+    filter_timer.count(matches.size());
+    filter_timer.stop();
+
+    saveMatches(debug, gray_a, keypoints_a, gray_b, keypoints_b, matches, "matches" + file_tag + "-maxdist.png");
+}
+
+
+int main(int argc, char **argv)
+{
+    Profiler profiler;
+
+    // parameters
+    string output      = "panorama-maxdist.png";
+    string renderer    = "inverse";
+    string accumulator = "float";
+    string nms         = "grid";
+    string descriptor  = "surf";
+    string cache_directory;
+    string profile;
+    bool   verbose     = false;
+    bool   guided      = false;
+    string debug_format = "png";
+    string filter      = "maxdist";
+    int    top         = 0;
+    int    bins        = 0;
+    int    num_threads = max(1u, thread::hardware_concurrency());
+
+    const struct option long_options[] = {
+        { "help",        no_argument,       0, 'h' },
+        { "output",      required_argument, 0, 'o' },
+        { "renderer",    required_argument, 0, 'r' },
+        { "accumulator", required_argument, 0, 'a' },
+        { "nms",         required_argument, 0, 's' },
+        { "descriptor",  required_argument, 0, 'd' },
+        { "threads",     required_argument, 0, 'j' },
+        { "cache",       required_argument, 0, 'c' },
+        { "profile",     required_argument, 0, 'p' },
+        { "verbose",     no_argument,       0, 'v' },
+        { "format",      required_argument, 0, 'f' },
+        { "filter",      required_argument, 0, 'm' },
+        { "top",         required_argument, 0, 'k' },
+        { "bins",        required_argument, 0, 'b' },
+        { "guided",      no_argument,       0, 'g' },
+        0 // end of parameter list
+    };
+
+    // parse command line options
+    while (true) {
+        int index  = -1;
+        int result = getopt_long(argc, argv, "ho:r:a:s:d:j:c:p:vf:m:k:b:g", long_options, &index);
+
+        // end of parameter list
+        if (result == -1) {
+            break;
+        }
+
+        switch (result) {
+            // help
+            case 'h':
+                usage();
+                return 0;
+
+            // output - filename of the panorama
+            case 'o':
+                output = optarg;
+                break;
+
+            // renderer
+            case 'r':
+                renderer = string(optarg);
+                if (renderer != "inverse" && renderer != "splat" && renderer != "multiband" &&
+                    renderer != "seam") {
+                    cerr << argv[0] << ": Invalid renderer: " << optarg << endl;
+                    return 1;
+                }
+                break;
+
+            // accumulation buffers of the splat renderer
+            case 'a':
+                accumulator = string(optarg);
+                if (accumulator != "double" && accumulator != "float" && accumulator != "fixed") {
+                    cerr << argv[0] << ": Invalid accumulator: " << optarg << endl;
+                    return 1;
+                }
+                break;
+
+            // non-maximum suppression
+            case 's':
+                nms = string(optarg);
+                if (nms != "grid" && nms != "deque") {
+                    cerr << argv[0] << ": Invalid non-maximum suppression: " << optarg << endl;
+                    return 1;
+                }
+                break;
+
+            // feature descriptor
+            case 'd':
+                descriptor = string(optarg);
+                if (descriptor != "surf" && descriptor != "orb") {
+                    cerr << argv[0] << ": Invalid descriptor: " << optarg << endl;
+                    return 1;
+                }
+                break;
+
+            // number of threads
+            case 'j':
+                num_threads = stoi(string(optarg));
+                if (num_threads <= 0) {
+                    cerr << argv[0] << ": Invalid number of threads: " << optarg << endl;
+                    return 1;
+                }
+                break;
+
+            // directory of the feature cache
+            case 'c':
+                cache_directory = optarg;
+                break;
+
+            // JSON report of the stage timings
+            case 'p':
+                profile = optarg;
+                break;
+
+            // debug images
+            case 'v':
+                verbose = true;
+                break;
+
+            // format of the debug images
+            case 'f':
+                debug_format = string(optarg);
+                if (debug_format != "png" && debug_format != "ppm") {
+                    cerr << argv[0] << ": Invalid debug image format: " << optarg << endl;
+                    return 1;
+                }
+                break;
+
+            // filter of the matches
+            case 'm':
+                filter = string(optarg);
+                if (filter != "maxdist" && filter != "ratio") {
+                    cerr << argv[0] << ": Invalid match filter: " << optarg << endl;
+                    return 1;
+                }
+                break;
+
+            // number of best matches
+            case 'k':
+                top = stoi(string(optarg));
+                if (top < 0) {
+                    cerr << argv[0] << ": Invalid number of matches: " << optarg << endl;
+                    return 1;
+                }
+                break;
+
+            // spatial binning of the matches
+            case 'b':
+                bins = stoi(string(optarg));
+                if (bins < 0) {
+                    cerr << argv[0] << ": Invalid number of bins: " << optarg << endl;
+                    return 1;
+                }
+                break;
+
+            // guided matching
+            case 'g':
+                guided = true;
+                break;
+
+            // missing option
+            case '?':
+                return 1;
+
+            // unknown
+            default:
+                cerr << "unknown parameter: " << optarg << endl;
+                break;
         }
     }
-    matches.resize(j);
 
-    if (verbose) {
-        Mat img_matches_nonmax;
-        drawMatches(
-            gray_left,  keypoints_left,              // left image with its keypoints
-            gray_right, keypoints_right,             // right image with its keypoints
-            matches,                                 // matches between the keypoints
-            img_matches_nonmax,                      // output image
-            Scalar::all(-1),                         // color of matches
-            Scalar::all(-1),                         // color of single points
-            vector<char>(),                          // mask determining which matches are drawn. If empty
-                                                     // all matches are drawn 
-            DrawMatchesFlags::NOT_DRAW_SINGLE_POINTS // Single keypoints will not be drawn
-        );
-        imwrite("matches-maxdist.png", img_matches_nonmax);
+    const int n = argc - optind;
+    if (n < 2) {
+        usage();
+        return 1;
+    }
+
+    // the debug images are finished when the writer goes out of scope
+    DebugWriter debug(verbose, debug_format);
+
+    // read images
+    ScopedTimer read_timer(profiler, "read");
+    vector<Mat> images(n);
+
+    for (int i = 0; i < n; i++) {
+        images[i] = imread(argv[optind + i], CV_LOAD_IMAGE_COLOR);
+        if (images[i].empty()) {
+            cerr << "Can not read " << argv[optind + i] << endl;
+            return 1;
+        }
+    }
+    read_timer.count(n);
+    cout << "Read images: " << read_timer.stop() * 1000. << " ms" << endl;
+
+
+    // Grayscale, feature / keypoint detection, non-maximum-suppression and
+    // descriptors. The images are processed concurrently, the threads that are
+    // left over tile the detection and description within an image.
+    // 
+    cout << "Detect keypoints ..." << endl;
+    ScopedTimer features_timer(profiler, "features");
+
+    vector<Mat> grays(n);
+    vector<vector<KeyPoint>> keypoints(n);
+    vector<Mat> descriptors(n);
+    vector<FeatureTimes> times(n);
+
+    FeatureCache cache(cache_directory);
+
+    const int image_threads = std::max(1, num_threads / n);
+
+    parallelFor(n, num_threads, [&](const int i) {
+        detectFeatures(images[i], descriptor, nms, image_threads, cache, profiler, imageTag(i, n),
+                       grays[i], keypoints[i], descriptors[i], times[i]);
+
+        if (debug.enabled()) {
+            const Mat gray = grays[i];
+            const vector<KeyPoint> kps = keypoints[i];
+            const string filename = "keypoints" + imageTag(i, n) + ".png";
+            const string format = debug.format();
+
+            debug.submit([=]() {
+                save_keypoints_as_image(gray, kps, filename.c_str(), format);
+            });
+        }
+    });
+
+    for (int i = 0; i < n; i++) {
+        cout << "  " << keypoints[i].size() << " keypoints " << imageTag(i, n)
+             << " (gray "     << times[i].gray     * 1000. << " ms";
+        if (!times[i].cached) {
+            cout << ", detect "   << times[i].detect   * 1000. << " ms"
+                 << ", nms "      << times[i].nms      * 1000. << " ms"
+                 << ", describe " << times[i].describe * 1000. << " ms";
+        }
+        if (cache.enabled()) {
+            cout << (times[i].cached ? ", cached " : ", cache ") << times[i].cache * 1000. << " ms";
+        }
+        cout << ")" << endl;
     }
+    cout << "Features: " << features_timer.stop() * 1000. << " ms" << endl;
 
-    cout << "Done" << endl;
 
+    // Matching of adjacent images
+    // 
+    cout << "Matching ..." << endl;
+    ScopedTimer matching_timer(profiler, "matching");
 
-    // find two homographies
+    vector<vector<DMatch>> matches(n - 1);
+
+    parallelFor(n - 1, num_threads, [&](const int i) {
+        matchFeatures(grays[i], keypoints[i], descriptors[i],
+                      grays[i + 1], keypoints[i + 1], descriptors[i + 1],
+                      guided, filter, top, bins, debug, pairFileTag(i, n), imageTag(i, n) + imageTag(i + 1, n),
+                      profiler, matches[i]);
+    });
+
+    for (int i = 0; i < n - 1; i++) {
+        cout << "  " << matches[i].size() << " matches " << imageTag(i, n) << "-" << imageTag(i + 1, n) << endl;
+
+        // findHomography() needs at least 4 point correspondences
+        if (matches[i].size() < 4) {
+            cerr << argv[0] << ": Not enough matches between " << argv[optind + i]
+                 << " and " << argv[optind + i + 1] << endl;
+            return 1;
+        }
+    }
+
+    cout << "Done: " << matching_timer.stop() * 1000. << " ms" << endl;
+
+
+    // find the homographies into the frame of the panorama
     // 
     cout  << "Start RANSAC ... ";
-    Mat Hl, Hr;
-    findHomographyLR(keypoints_left, keypoints_right, matches, Hl, Hr);
-    cout << "done" << endl;
+    ScopedTimer ransac_timer(profiler, "ransac");
+    vector<Homography> homographies(n);
+
+    if (n == 2) {
+        // project both images onto the middle plane
+        findHomographyLR(keypoints[0], keypoints[1], matches[0], homographies[0], homographies[1]);
+    } else {
+        // chain the homographies between adjacent images to the middle image
+        vector<Homography> pairwise(n - 1);
+
+        parallelFor(n - 1, num_threads, [&](const int i) {
+            pairwise[i] = findHomographyPair(keypoints[i], keypoints[i + 1], matches[i]);
+        });
+        chainHomographies(pairwise, n / 2, homographies);
+    }
+    ransac_timer.count(n - 1);
+    cout << "done: " << ransac_timer.stop() * 1000. << " ms" << endl;
 
     // render the output
     // 
     cout << "Render ... " << endl;
-    render(img_left.rows, img_left.cols, img_left, img_right.rows, img_right.cols, img_right, Hl, Hr, "panorama-maxdist.png");
-    cout << "done" << endl;
+    ScopedTimer render_timer(profiler, "render");
+    if (renderer == "inverse") {
+        renderInverse(images, homographies, output.c_str(), num_threads);
+    } else if (renderer == "multiband") {
+        renderMultiBand(images, homographies, output.c_str(), num_threads);
+    } else if (renderer == "seam") {
+        renderSeam(images, homographies, output.c_str(), num_threads, debug);
+    } else { // renderer == "splat"
+        render(images, homographies, output.c_str(), accumulator);
+    }
+    cout << "done: " << render_timer.stop() * 1000. << " ms" << endl;
+
+    if (!profile.empty()) {
+        const string parameters = "renderer=" + renderer + " accumulator=" + accumulator
+                                + " nms=" + nms + " descriptor=" + descriptor
+                                + " guided=" + to_string(guided) + " filter=" + filter + " top=" + to_string(top) + " bins=" + to_string(bins)
+                                + " threads=" + to_string(num_threads) + " images=" + to_string(n);
+
+        if (!profiler.writeJSON(profile.c_str(), parameters)) {
+            cerr << "Can not write " << profile << endl;
+            return 1;
+        }
+    }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -6,49 +6,430 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/features2d/features2d.hpp>  // KeyPoint, DMatch
 
+#include <stdio.h>
+#include <vector>
+#include <string>
+#include <thread>  // std::thread
+#include <atomic>  // std::atomic
+#include <mutex>   // std::mutex
+#include <chrono>  // std::chrono::steady_clock
+#include <deque>
+#include <functional>          // std::function
+#include <condition_variable>
+#include <stdint.h>
+
 // saves.cpp: save_double_as_image() will rescale the input to [0, 255]
 #define RESCALE_MINMAX
 
-#define VERBOSE
 
-#ifdef VERBOSE
-    const bool verbose = true;
-#else
-    const bool verbose = false;
-#endif
+/**
+ * k nearest neighbors of a set of descriptors in flat, k-wide rows, ordered by
+ * distance. Rows with less than k neighbors are padded with index -1.
+ */
+struct PreferenceTable
+{
+    int rows;
+    int k;
+    std::vector<int>   index;    // rows x k, index of the neighbor
+    std::vector<float> distance; // rows x k
+
+    PreferenceTable() : rows(0), k(0) {}
+
+    void resize(const int rows, const int k);
+
+    // converts the result of cv::DescriptorMatcher::knnMatch()
+    void assign(const std::vector<std::vector<cv::DMatch>>& table, const int k);
+
+    inline const int* row(const int i) const { return &index[i * k]; }
+};
+
+void stableMarriage(const PreferenceTable& acceptors,
+                    const PreferenceTable& proposers,
+                    std::vector<cv::DMatch>& matches,
+                    std::vector<float>* ratios = NULL);
 
 void marriageMatch(const cv::Mat& descriptors_left,
                    const cv::Mat& descriptors_right,
                    cv::DescriptorMatcher& matcher,
                    const int k,
-                   cv::vector<cv::DMatch>& matches);
+                   cv::vector<cv::DMatch>& matches,
+                   std::vector<float>* ratios = NULL);
+
+void marriageMatchHamming(const cv::Mat& descriptors_left,
+                          const cv::Mat& descriptors_right,
+                          const int k,
+                          std::vector<cv::DMatch>& matches,
+                          std::vector<float>* ratios = NULL);
+
+bool guidedMatch(const std::vector<cv::KeyPoint>& keypoints_left, const cv::Mat& descriptors_left,
+                 const std::vector<cv::KeyPoint>& keypoints_right, const cv::Mat& descriptors_right,
+                 const int k, const double radius,
+                 std::vector<cv::DMatch>& matches, std::vector<float>* ratios = NULL);
+
+void ratioTest(const std::vector<float>& ratios, const float max_ratio, std::vector<cv::DMatch>& matches);
+
+void selectBestMatches(const int count, std::vector<cv::DMatch>& matches);
+
+void binMatches(const std::vector<cv::KeyPoint>& keypoints, const cv::Size& size, const int bins, const int count,
+                std::vector<cv::DMatch>& matches);
+
+void knnMatchHamming(const cv::Mat& query, const cv::Mat& train,
+                     PreferenceTable& table, const int k);
 
 void suppressNonMax(int width, int height, std::vector<cv::KeyPoint>& keypoints, int radius);
+void suppressNonMaxGrid(int width, int height, std::vector<cv::KeyPoint>& keypoints, int radius);
 
 // 
 // Save methods
 // 
 
-void save_double_as_image(int height, int width, double *array, const char *name);
+class DebugWriter;
+
+bool writeImage(const std::string& filename, const cv::Mat& image, const std::string& format);
 
-void save_keypoints_as_image(const cv::Mat& image, const std::vector<cv::KeyPoint>& keypoints, const char* filename);
+void save_double_as_image(int height, int width, const double *array, const char *name,
+                          DebugWriter *writer = NULL);
 
+void save_keypoints_as_image(const cv::Mat& image, const std::vector<cv::KeyPoint>& keypoints, const char* filename,
+                             const std::string& format = "png");
 
-inline void ht(double x0, double y0, cv::Mat &H, double *x, double *y)
+/**
+ * Runs the jobs that draw and encode the debug images (keypoints, matches) on
+ * a background thread, so the stitching never waits for them. A disabled
+ * writer has no thread and drops every job.
+ */
+class DebugWriter
 {
-    cv::Mat point1 = (cv::Mat_<double>(3, 1) << x0, y0, 1.);
-    cv::Mat point2 = H * point1;
-    *x = point2.at<double>(0, 0) / point2.at<double>(2, 0);
-    *y = point2.at<double>(1, 0) / point2.at<double>(2, 0);
-}
+public:
+    // format of the images, see writeImage()
+    DebugWriter(const bool enabled, const std::string& format = "png");
+
+    // finishes all pending jobs
+    ~DebugWriter();
+
+    bool enabled() const { return active; }
+
+    const std::string& format() const { return image_format; }
+
+    // the job must not refer to data that may change or go out of scope
+    void submit(const std::function<void()>& job);
+
+    // encodes the image in the background
+    void write(const std::string& filename, const cv::Mat& image);
+
+private:
+    // not copyable
+    DebugWriter(const DebugWriter&);
+    DebugWriter& operator=(const DebugWriter&);
+
+    void run();
+
+    bool active;
+    bool finished;
+    std::deque<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::thread worker;
+    std::string image_format;
+};
+
+/**
+ * Writes an 8 bit BGR image as binary PPM (P6) strip by strip. Only a single
+ * row is buffered, so the whole image never has to be in memory.
+ */
+class PPMStripWriter
+{
+public:
+    PPMStripWriter() : file(NULL) {}
+    ~PPMStripWriter() { close(); }
+
+    // writes the header of a width x height image
+    bool open(const char *filename, int width, int height);
+
+    // appends the rows of the strip (CV_8UC3) to the image
+    void write(const cv::Mat& strip);
+
+    void close();
+
+private:
+    // not copyable
+    PPMStripWriter(const PPMStripWriter&);
+    PPMStripWriter& operator=(const PPMStripWriter&);
+
+    FILE *file;
+    std::vector<unsigned char> row; // RGB
+};
+
+
+/**
+ * On-disk cache of the keypoints and descriptors of images, so repeated runs on
+ * the same images skip the feature detection. Every entry is a binary file
+ * named after a 64 bit key of the image content and the detector parameters.
+ *
+ * The entries are memory-mapped: the descriptors of a loaded entry point
+ * directly into the mapping and stay valid as long as the cache exists.
+ */
+class FeatureCache
+{
+public:
+    // an empty directory disables the cache
+    explicit FeatureCache(const std::string& directory);
+    ~FeatureCache();
+
+    bool enabled() const { return !directory.empty(); }
+
+    // hash of the pixels of the image and the parameters
+    static uint64_t key(const cv::Mat& image, const std::string& parameters);
+
+    bool load(const uint64_t key, std::vector<cv::KeyPoint>& keypoints, cv::Mat& descriptors);
+
+    bool store(const uint64_t key, const std::vector<cv::KeyPoint>& keypoints, const cv::Mat& descriptors);
+
+private:
+    // not copyable
+    FeatureCache(const FeatureCache&);
+    FeatureCache& operator=(const FeatureCache&);
+
+    std::string filename(const uint64_t key) const;
+
+    std::string directory;
+
+    // address and length of the mapped entries
+    std::vector<std::pair<void*, size_t>> mappings;
+    std::mutex mutex;
+};
+
 
-void render(int heightl, int widthl, cv::Mat &imgl,
-            int heightr, int widthr, cv::Mat &imgr,
-            cv::Mat Hl, cv::Mat Hr, const char *name);
+/**
+ * Collects the wall clock time, an item count and the memory usage of the
+ * stages of a run, and writes them as JSON report. Stages may be recorded
+ * concurrently.
+ */
+class Profiler
+{
+public:
+    struct Stage
+    {
+        std::string name;
+        std::string item;   // image or image pair, empty for the whole run
+        double seconds;
+        long count;         // e.g. keypoints or matches, -1 if not counted
+        long rss_kb;        // resident memory at the end of the stage
+        long peak_rss_kb;   // peak resident memory of the process so far
+    };
+
+    Profiler();
+
+    void record(const Stage& stage);
+
+    // seconds since the profiler was created
+    double total() const;
+
+    bool writeJSON(const char *filename, const std::string& parameters) const;
+
+private:
+    std::chrono::steady_clock::time_point start;
+    std::vector<Stage> stages;
+    mutable std::mutex mutex;
+};
+
+/**
+ * Measures a stage from its construction until stop() or its destruction and
+ * records it in the profiler. The seconds are also written to an optional
+ * output variable.
+ */
+class ScopedTimer
+{
+public:
+    ScopedTimer(Profiler& profiler, const std::string& name, const std::string& item = "",
+                double *seconds = NULL);
+    ~ScopedTimer() { stop(); }
+
+    void count(const long count) { stage.count = count; }
+
+    // records the stage once and returns its seconds
+    double stop();
+
+private:
+    Profiler& profiler;
+    Profiler::Stage stage;
+    std::chrono::steady_clock::time_point start;
+    double *seconds;
+    bool stopped;
+};
+
+
+/**
+ * Fixed-size 3x3 homography. In contrast to a cv::Mat it is a plain value on
+ * the stack, so transforming points does not allocate anything.
+ */
+struct Homography
+{
+    double h[9]; // row major
+
+    // identity
+    Homography() : h { 1., 0., 0., 0., 1., 0., 0., 0., 1. } {}
+
+    // converts a 3x3 matrix of type CV_64F or CV_32F, e.g. the result of cv::findHomography()
+    explicit Homography(const cv::Mat& H)
+    {
+        cv::Mat H64;
+        H.convertTo(H64, CV_64F);
+
+        for (int i = 0; i < 9; i++) {
+            h[i] = H64.at<double>(i / 3, i % 3);
+        }
+    }
+
+    cv::Mat mat() const
+    {
+        return (cv::Mat_<double>(3, 3) << h[0], h[1], h[2],
+                                          h[3], h[4], h[5],
+                                          h[6], h[7], h[8]);
+    }
+
+    Homography operator*(const Homography& other) const
+    {
+        Homography result;
+        const double *b = other.h;
+
+        for (int row = 0; row < 3; row++) {
+            for (int col = 0; col < 3; col++) {
+                result.h[row * 3 + col] = h[row * 3 + 0] * b[0 + col]
+                                        + h[row * 3 + 1] * b[3 + col]
+                                        + h[row * 3 + 2] * b[6 + col];
+            }
+        }
+        return result;
+    }
+
+    // inverse by the adjugate matrix
+    Homography inv() const
+    {
+        Homography result;
+        const double det = h[0] * (h[4] * h[8] - h[5] * h[7])
+                         - h[1] * (h[3] * h[8] - h[5] * h[6])
+                         + h[2] * (h[3] * h[7] - h[4] * h[6]);
+        const double s = 1. / det;
+
+        result.h[0] =  (h[4] * h[8] - h[5] * h[7]) * s;
+        result.h[1] = -(h[1] * h[8] - h[2] * h[7]) * s;
+        result.h[2] =  (h[1] * h[5] - h[2] * h[4]) * s;
+        result.h[3] = -(h[3] * h[8] - h[5] * h[6]) * s;
+        result.h[4] =  (h[0] * h[8] - h[2] * h[6]) * s;
+        result.h[5] = -(h[0] * h[5] - h[2] * h[3]) * s;
+        result.h[6] =  (h[3] * h[7] - h[4] * h[6]) * s;
+        result.h[7] = -(h[0] * h[7] - h[1] * h[6]) * s;
+        result.h[8] =  (h[0] * h[4] - h[1] * h[3]) * s;
+        return result;
+    }
+
+    // transforms a single point
+    inline void apply(double x0, double y0, double *x, double *y) const
+    {
+        const double w = 1. / (h[6] * x0 + h[7] * y0 + h[8]);
+        *x = (h[0] * x0 + h[1] * y0 + h[2]) * w;
+        *y = (h[3] * x0 + h[4] * y0 + h[5]) * w;
+    }
+
+    inline cv::Point2d operator()(const cv::Point2d& p) const
+    {
+        cv::Point2d result;
+        apply(p.x, p.y, &result.x, &result.y);
+        return result;
+    }
+
+    // transforms n points, src and dst may be the same array
+    inline void transform(const cv::Point2d *src, cv::Point2d *dst, int n) const
+    {
+        for (int i = 0; i < n; i++) {
+            apply(src[i].x, src[i].y, &dst[i].x, &dst[i].y);
+        }
+    }
+
+    /**
+     * Transforms the n pixels (x0, y), (x0 + 1, y), ... of an image row. The
+     * homogeneous coordinates are linear in x, so only the per-row offsets are
+     * computed once. There is no dependency between the iterations, which lets
+     * the compiler vectorize the loop.
+     */
+    inline void transformRow(double x0, double y, int n, double *xs, double *ys) const
+    {
+        const double x = h[0] * x0 + h[1] * y + h[2];
+        const double v = h[3] * x0 + h[4] * y + h[5];
+        const double w = h[6] * x0 + h[7] * y + h[8];
+
+        for (int i = 0; i < n; i++) {
+            const double inv = 1. / (w + i * h[6]);
+            xs[i] = (x + i * h[0]) * inv;
+            ys[i] = (v + i * h[3]) * inv;
+        }
+    }
+};
+
+/**
+ * Forward mapping renderer
+ *
+ * @param images       Color images of the panorama
+ * @param homographies Homographies from each image into the panorama
+ * @param accumulator  Type of the accumulation buffers: "double", "float"
+ *                     or "fixed" (32 bit fixed-point)
+ */
+void render(const std::vector<cv::Mat>& images, const std::vector<Homography>& homographies,
+            const char *name, const std::string& accumulator);
+
+void renderInverse(const std::vector<cv::Mat>& images, const std::vector<Homography>& homographies,
+                   const char *name, const int num_threads);
+
+void renderMultiBand(const std::vector<cv::Mat>& images, const std::vector<Homography>& homographies,
+                     const char *name, const int num_threads);
+
+void renderSeam(const std::vector<cv::Mat>& images, const std::vector<Homography>& homographies,
+                const char *name, const int num_threads, DebugWriter& debug);
+
+void refineHomography(const cv::Point2d *src, const cv::Point2d *dst, const int n,
+                      Homography& H, const int steps);
+
+Homography findHomographyRansac(const std::vector<cv::Point2d>& src, const std::vector<cv::Point2d>& dst,
+                                const double threshold, std::vector<unsigned char>& inliers);
 
 void findHomographyLR(const std::vector<cv::KeyPoint>& keypoints_left,
                       const std::vector<cv::KeyPoint>& keypoints_right,
                       const std::vector<cv::DMatch>& matches,
-                      cv::Mat& Hl, cv::Mat& Hr);
+                      Homography& Hl, Homography& Hr);
+
+Homography findHomographyPair(const std::vector<cv::KeyPoint>& keypoints_a,
+                              const std::vector<cv::KeyPoint>& keypoints_b,
+                              const std::vector<cv::DMatch>& matches);
+
+void chainHomographies(const std::vector<Homography>& pairwise, const int reference,
+                       std::vector<Homography>& homographies);
+
+
+/**
+ * Calls body(i) for every i in [0, n) on a pool of num_threads threads. The
+ * indices are handed out dynamically to balance the load between the threads.
+ */
+template <typename Body>
+void parallelFor(const int n, const int num_threads, Body body)
+{
+    std::atomic<int> next(0);
+
+    auto worker = [&]() {
+        for (int i = next++; i < n; i = next++) {
+            body(i);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int t = 1; t < num_threads && t < n; t++) {
+        threads.push_back(std::thread(worker));
+    }
+    worker(); // the calling thread works too
+
+    for (int t = 0; t < threads.size(); t++) {
+        threads[t].join();
+    }
+}
 
 #endif
\ No newline at end of file
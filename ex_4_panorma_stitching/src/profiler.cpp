@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <iostream>
+#include <unistd.h>        // sysconf()
+#include <sys/resource.h>  // getrusage()
+
+#include "panorama.hpp"
+
+using namespace std;
+
+
+/**
+ * Resident memory of the process in KB, read from /proc/self/statm. -1 if it
+ * is not available.
+ */
+static long residentKB()
+{
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file == NULL) {
+        return -1;
+    }
+
+    long size, resident;
+    const bool ok = fscanf(file, "%ld %ld", &size, &resident) == 2;
+    fclose(file);
+
+    return ok ? resident * (sysconf(_SC_PAGESIZE) / 1024) : -1;
+}
+
+
+// peak resident memory of the process in KB (Linux reports ru_maxrss in KB)
+static long peakResidentKB()
+{
+    struct rusage usage;
+    return getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : -1;
+}
+
+
+// JSON string literal
+static string quote(const string& text)
+{
+    string result = "\"";
+    for (int i = 0; i < text.size(); i++) {
+        if (text[i] == '"' || text[i] == '\\') {
+            result += '\\';
+        }
+        result += text[i];
+    }
+    return result + "\"";
+}
+
+
+Profiler::Profiler() : start(chrono::steady_clock::now())
+{
+}
+
+
+void Profiler::record(const Stage& stage)
+{
+    lock_guard<std::mutex> lock(mutex);
+    stages.push_back(stage);
+}
+
+
+double Profiler::total() const
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+
+/**
+ * Writes the report:
+ *
+ *   {
+ *     "parameters": "...",
+ *     "total_seconds": 1.23,
+ *     "peak_rss_kb": 123456,
+ *     "stages": [
+ *       { "name": "detect", "item": "L", "seconds": 0.1, "count": 1234,
+ *         "rss_kb": 1234, "peak_rss_kb": 1234 },
+ *       ...
+ *     ]
+ *   }
+ *
+ * The stages are in the order they were finished. "item" and "count" are
+ * omitted if they are not set.
+ */
+bool Profiler::writeJSON(const char *filename, const string& parameters) const
+{
+    FILE *file = fopen(filename, "w");
+    if (file == NULL) {
+        return false;
+    }
+
+    lock_guard<std::mutex> lock(mutex);
+
+    fprintf(file, "{\n");
+    fprintf(file, "  \"parameters\": %s,\n", quote(parameters).c_str());
+    fprintf(file, "  \"total_seconds\": %.6f,\n", total());
+    fprintf(file, "  \"peak_rss_kb\": %ld,\n", peakResidentKB());
+    fprintf(file, "  \"stages\": [\n");
+
+    for (int i = 0; i < stages.size(); i++) {
+        const Stage& stage = stages[i];
+
+        fprintf(file, "    { \"name\": %s", quote(stage.name).c_str());
+        if (!stage.item.empty()) {
+            fprintf(file, ", \"item\": %s", quote(stage.item).c_str());
+        }
+        fprintf(file, ", \"seconds\": %.6f", stage.seconds);
+        if (stage.count >= 0) {
+            fprintf(file, ", \"count\": %ld", stage.count);
+        }
+        fprintf(file, ", \"rss_kb\": %ld, \"peak_rss_kb\": %ld }%s\n",
+                stage.rss_kb, stage.peak_rss_kb, (i + 1 < stages.size()) ? "," : "");
+    }
+
+    fprintf(file, "  ]\n");
+    fprintf(file, "}\n");
+
+    return fclose(file) == 0;
+}
+
+
+ScopedTimer::ScopedTimer(Profiler& profiler, const string& name, const string& item, double *seconds)
+    : profiler(profiler), start(chrono::steady_clock::now()), seconds(seconds), stopped(false)
+{
+    stage.name  = name;
+    stage.item  = item;
+    stage.count = -1;
+}
+
+
+double ScopedTimer::stop()
+{
+    if (!stopped) {
+        stopped = true;
+
+        stage.seconds     = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        stage.rss_kb      = residentKB();
+        stage.peak_rss_kb = peakResidentKB();
+        profiler.record(stage);
+
+        if (seconds != NULL) {
+            *seconds = stage.seconds;
+        }
+    }
+    return stage.seconds;
+}
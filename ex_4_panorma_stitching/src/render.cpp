@@ -5,6 +5,10 @@ using namespace std;
 #include <stdlib.h>
 #include <time.h>
 #include <fstream>
+#include <limits>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h> // strcasecmp()
 
 // opencv
 #include <opencv2/core/core.hpp>
@@ -15,170 +19,1171 @@ using namespace cv;
 
 #include "panorama.hpp"
 
+// The border weight e / (1 + e) with e = exp((dist - 20) / 5) is tabulated
+// with WEIGHT_LUT_STEPS samples per pixel up to WEIGHT_LUT_RANGE pixels from
+// the image border. Further inside the weight differs from 1 by less than 1e-6.
+static const int WEIGHT_LUT_RANGE = 96;
+static const int WEIGHT_LUT_STEPS = 8;
+
+/**
+ * Lookup table of the border weight, so the renderers do not evaluate exp()
+ * per pixel. Between the samples the weight is interpolated linearly. At
+ * integer distances the table holds the weight rounded to float, so the
+ * renderers agree with exp() within rounding, not bit for bit.
+ */
+struct BorderWeights
+{
+    float table[WEIGHT_LUT_RANGE * WEIGHT_LUT_STEPS + 2];
+
+    BorderWeights()
+    {
+        for (int i = 0; i < WEIGHT_LUT_RANGE * WEIGHT_LUT_STEPS + 2; i++) {
+            const double e = exp(((double) i / WEIGHT_LUT_STEPS - 20.) / 5.);
+            table[i] = e / (1. + e);
+        }
+    }
+
+    // dist >= 0
+    inline float operator()(float dist) const
+    {
+        const float s = std::min(dist * WEIGHT_LUT_STEPS, (float) (WEIGHT_LUT_RANGE * WEIGHT_LUT_STEPS));
+        const int i = (int) s;
+        return table[i] + (s - i) * (table[i + 1] - table[i]);
+    }
+};
+
+static const BorderWeights border_weights;
+
 double get_weight(int i, int j, int height, int width)
 {
-    double dist = i;
+    int dist = i;
     if (height - 1 - i < dist) dist = height - 1 - i;
     if (j < dist) dist = j;
     if (width - 1 - j < dist) dist = width - 1 - j;
-    dist = exp((dist - 20.) / 5.);
-    return dist / (1. + dist);
+    return border_weights.table[std::min(dist, WEIGHT_LUT_RANGE) * WEIGHT_LUT_STEPS];
 }
 
-void render(int heightl, int widthl, Mat &imgl,
-            int heightr, int widthr, Mat &imgr,
-            Mat Hl, Mat Hr, const char *name)
+/**
+ * Extends the bounding box [xmin, xmax] x [ymin, ymax] by the corners of an
+ * image of the given size, transformed with the homography H
+ */
+static void extendBounds(const Homography& H, int height, int width,
+                         double& xmin, double& xmax, double& ymin, double& ymax)
 {
+    const double corners[4][2] = {
+        { 0.,          0.           },
+        { width - 1.,  0.           },
+        { 0.,          height - 1.  },
+        { width - 1.,  height - 1.  }
+    };
 
-    // sizes
-    double x, y;
-    double xmin = widthl;
-    double xmax = 0.;
-    double ymin = heightl;
-    double ymax = 0.;
+    for (int c = 0; c < 4; c++) {
+        double x, y;
+        H.apply(corners[c][0], corners[c][1], &x, &y);
+        if (x < xmin) xmin = x;
+        if (x > xmax) xmax = x;
+        if (y < ymin) ymin = y;
+        if (y > ymax) ymax = y;
+    }
+}
 
-    // left image -- transform corners to estimate sizes
-    ht(0., 0., Hl, &x, &y);
-    if (x < xmin) xmin = x;
-    if (x > xmax) xmax = x;
-    if (y < ymin) ymin = y;
-    if (y > ymax) ymax = y;
-    ht(widthl - 1., 0., Hl, &x, &y);
-    if (x < xmin) xmin = x;
-    if (x > xmax) xmax = x;
-    if (y < ymin) ymin = y;
-    if (y > ymax) ymax = y;
-    ht(0., heightl - 1., Hl, &x, &y);
-    if (x < xmin) xmin = x;
-    if (x > xmax) xmax = x;
-    if (y < ymin) ymin = y;
-    if (y > ymax) ymax = y;
-    ht(widthl - 1., heightl - 1., Hl, &x, &y);
-    if (x < xmin) xmin = x;
-    if (x > xmax) xmax = x;
-    if (y < ymin) ymin = y;
-    if (y > ymax) ymax = y;
-
-    // right image -- transform corners to estimate sizes
-    ht(0., 0., Hr, &x, &y);
-    if (x < xmin) xmin = x;
-    if (x > xmax) xmax = x;
-    if (y < ymin) ymin = y;
-    if (y > ymax) ymax = y;
-    ht(widthr - 1., 0., Hr, &x, &y);
-    if (x < xmin) xmin = x;
-    if (x > xmax) xmax = x;
-    if (y < ymin) ymin = y;
-    if (y > ymax) ymax = y;
-    ht(0., heightr - 1., Hr, &x, &y);
-    if (x < xmin) xmin = x;
-    if (x > xmax) xmax = x;
-    if (y < ymin) ymin = y;
-    if (y > ymax) ymax = y;
-    ht(widthr - 1., heightr - 1., Hr, &x, &y);
-    if (x < xmin) xmin = x;
-    if (x > xmax) xmax = x;
-    if (y < ymin) ymin = y;
-    if (y > ymax) ymax = y;
+/**
+ * Accumulator types of render(). Floating point accumulators sum up the weights
+ * directly. The fixed-point accumulator quantizes every weight to 1/4096, so a
+ * canvas pixel can take about 4000 full-weight contributions of an image
+ * without overflow.
+ */
+template<typename Acc>
+struct AccumTraits
+{
+    static const int scale = 1;
+    static inline Acc quantize(double weight) { return weight; }
+};
 
-    double shifty = -ymin + 2.5;
-    double shiftx = -xmin + 2.5;
-    int height = (int)(ymax - ymin + 5.);
-    int width = (int)(xmax - xmin + 5.);
+template<>
+struct AccumTraits<uint32_t>
+{
+    static const int scale = 4096;
+    static inline uint32_t quantize(double weight) { return (uint32_t)(weight * scale + 0.5); }
+};
 
-    double *rr = new double[height * width];
-    double *gg = new double[height * width];
-    double *bb = new double[height * width];
-    double *ww = new double[height * width];
-    unsigned char *pimgl = imgl.ptr(0);
-    unsigned char *pimgr = imgr.ptr(0);
-
-    for (int i = 0; i < height * width; i++) {
-        rr[i] = gg[i] = bb[i] = 0.;
-        ww[i] = 0.001;
-    }
-
-    // stamp the left image
-    for (int i = 0; i < heightl; i++) {
-        for (int j = 0; j < widthl; j++) {
-            double x, y;
-            ht(j, i, Hl, &x, &y);
-            x += shiftx;
-            y += shifty;
-            int jm = (int)x;
-            int jp = jm + 1;
-            int im = (int)y;
-            int ip = im + 1;
-            double wjm = (1. - x + jm);
-            double wjp = (1. - wjm);
-            double wim = (1. - y + im);
-            double wip = (1. - wim);
-            double gw = get_weight(i, j, heightl, widthl);
-            rr[im * width + jm] += pimgl[(i * widthl + j) * 3 + 0] * wim * wjm * gw;
-            gg[im * width + jm] += pimgl[(i * widthl + j) * 3 + 1] * wim * wjm * gw;
-            bb[im * width + jm] += pimgl[(i * widthl + j) * 3 + 2] * wim * wjm * gw;
-            ww[im * width + jm] += wim * wjm * gw;
-            rr[im * width + jp] += pimgl[(i * widthl + j) * 3 + 0] * wim * wjp * gw;
-            gg[im * width + jp] += pimgl[(i * widthl + j) * 3 + 1] * wim * wjp * gw;
-            bb[im * width + jp] += pimgl[(i * widthl + j) * 3 + 2] * wim * wjp * gw;
-            ww[im * width + jp] += wim * wjp * gw;
-            rr[ip * width + jm] += pimgl[(i * widthl + j) * 3 + 0] * wip * wjm * gw;
-            gg[ip * width + jm] += pimgl[(i * widthl + j) * 3 + 1] * wip * wjm * gw;
-            bb[ip * width + jm] += pimgl[(i * widthl + j) * 3 + 2] * wip * wjm * gw;
-            ww[ip * width + jm] += wip * wjm * gw;
-            rr[ip * width + jp] += pimgl[(i * widthl + j) * 3 + 0] * wip * wjp * gw;
-            gg[ip * width + jp] += pimgl[(i * widthl + j) * 3 + 1] * wip * wjp * gw;
-            bb[ip * width + jp] += pimgl[(i * widthl + j) * 3 + 2] * wip * wjp * gw;
-            ww[ip * width + jp] += wip * wjp * gw;
-        }
-    }
-
-    // stamp the right image
-    for (int i = 0; i < heightr; i++) {
-        for (int j = 0; j < widthr; j++) {
-            double x, y;
-            ht(j, i, Hr, &x, &y);
-            x += shiftx;
-            y += shifty;
+/**
+ * Accumulation buffer of a single image. It only covers the bounding box of
+ * the warped image on the canvas. Every pixel holds the interleaved weighted
+ * channels and the sum of weights.
+ */
+template<typename Acc>
+struct Footprint
+{
+    int x0, y0;          // top left corner on the canvas
+    int width, height;
+    vector<Acc> acc;     // height x width x (b, g, r, w)
+
+    Footprint(int x0, int y0, int width, int height)
+        : x0(x0), y0(y0), width(width), height(height), acc(4 * width * height, Acc(0)) {}
+
+    inline Acc* at(int row, int col) { return &acc[4 * ((row - y0) * width + (col - x0))]; }
+};
+
+/**
+ * Splats every pixel of an image onto the four nearest canvas pixels of its
+ * transformed position. The canvas is only accumulated over the footprint of
+ * the image.
+ */
+template<typename Acc>
+static void splatImage(const Mat& image, const Homography& H, double shiftx, double shifty,
+                       Footprint<Acc>& fp)
+{
+    // transformed coordinates of a row
+    vector<double> xs(image.cols);
+    vector<double> ys(image.cols);
+
+    for (int i = 0; i < image.rows; i++) {
+        const unsigned char *pimg = image.ptr(i);
+
+        H.transformRow(0., i, image.cols, &xs[0], &ys[0]);
+
+        for (int j = 0; j < image.cols; j++, pimg += 3) {
+            double x = xs[j] + shiftx;
+            double y = ys[j] + shifty;
             int jm = (int)x;
-            int jp = jm + 1;
             int im = (int)y;
-            int ip = im + 1;
             double wjm = (1. - x + jm);
             double wjp = (1. - wjm);
             double wim = (1. - y + im);
             double wip = (1. - wim);
-            double gw = get_weight(i, j, heightr, widthr);
-            rr[im * width + jm] += pimgr[(i * widthr + j) * 3 + 0] * wim * wjm * gw;
-            gg[im * width + jm] += pimgr[(i * widthr + j) * 3 + 1] * wim * wjm * gw;
-            bb[im * width + jm] += pimgr[(i * widthr + j) * 3 + 2] * wim * wjm * gw;
-            ww[im * width + jm] += wim * wjm * gw;
-            rr[im * width + jp] += pimgr[(i * widthr + j) * 3 + 0] * wim * wjp * gw;
-            gg[im * width + jp] += pimgr[(i * widthr + j) * 3 + 1] * wim * wjp * gw;
-            bb[im * width + jp] += pimgr[(i * widthr + j) * 3 + 2] * wim * wjp * gw;
-            ww[im * width + jp] += wim * wjp * gw;
-            rr[ip * width + jm] += pimgr[(i * widthr + j) * 3 + 0] * wip * wjm * gw;
-            gg[ip * width + jm] += pimgr[(i * widthr + j) * 3 + 1] * wip * wjm * gw;
-            bb[ip * width + jm] += pimgr[(i * widthr + j) * 3 + 2] * wip * wjm * gw;
-            ww[ip * width + jm] += wip * wjm * gw;
-            rr[ip * width + jp] += pimgr[(i * widthr + j) * 3 + 0] * wip * wjp * gw;
-            gg[ip * width + jp] += pimgr[(i * widthr + j) * 3 + 1] * wip * wjp * gw;
-            bb[ip * width + jp] += pimgr[(i * widthr + j) * 3 + 2] * wip * wjp * gw;
-            ww[ip * width + jp] += wip * wjp * gw;
+            double gw = get_weight(i, j, image.rows, image.cols);
+
+            const Acc weights[4] = {
+                AccumTraits<Acc>::quantize(wim * wjm * gw),
+                AccumTraits<Acc>::quantize(wim * wjp * gw),
+                AccumTraits<Acc>::quantize(wip * wjm * gw),
+                AccumTraits<Acc>::quantize(wip * wjp * gw)
+            };
+            Acc *corners[4] = {
+                fp.at(im,     jm),
+                fp.at(im,     jm + 1),
+                fp.at(im + 1, jm),
+                fp.at(im + 1, jm + 1)
+            };
+
+            for (int c = 0; c < 4; c++) {
+                corners[c][0] += pimg[0] * weights[c];
+                corners[c][1] += pimg[1] * weights[c];
+                corners[c][2] += pimg[2] * weights[c];
+                corners[c][3] += weights[c];
+            }
         }
     }
+}
+
+/**
+ * Forward mapping renderer. Every image is splatted into its own footprint
+ * buffer. The footprints are blended row by row into the output, so there is
+ * no accumulation buffer over the whole canvas.
+ */
+template<typename Acc>
+static void renderSplat(const vector<Mat>& images, const vector<Homography>& homographies,
+                        const char *name)
+{
+    // sizes
+    double xmin = images[0].cols;
+    double xmax = 0.;
+    double ymin = images[0].rows;
+    double ymax = 0.;
+
+    // transform corners to estimate sizes
+    for (int k = 0; k < images.size(); k++) {
+        extendBounds(homographies[k], images[k].rows, images[k].cols, xmin, xmax, ymin, ymax);
+    }
+
+    double shifty = -ymin + 2.5;
+    double shiftx = -xmin + 2.5;
+    int height = (int)(ymax - ymin + 5.);
+    int width = (int)(xmax - xmin + 5.);
+
+    vector<Footprint<Acc>> footprints;
+    footprints.reserve(images.size());
+
+    for (int k = 0; k < images.size(); k++) {
+        double fxmin = numeric_limits<double>::max();
+        double fxmax = -fxmin;
+        double fymin = fxmin;
+        double fymax = fxmax;
+        extendBounds(homographies[k], images[k].rows, images[k].cols, fxmin, fxmax, fymin, fymax);
+
+        // one extra pixel for the bilinear neighbours
+        const int x0 = (int)(fxmin + shiftx);
+        const int y0 = (int)(fymin + shifty);
+        const int x1 = std::min((int)(fxmax + shiftx) + 2, width);
+        const int y1 = std::min((int)(fymax + shifty) + 2, height);
+
+        footprints.push_back(Footprint<Acc>(x0, y0, x1 - x0, y1 - y0));
+        splatImage(images[k], homographies[k], shiftx, shifty, footprints.back());
+    }
+
+    // blend the footprints row by row
+    const double eps = 0.001 * AccumTraits<Acc>::scale;
+    vector<Acc> row(4 * width);
 
     Mat out(height, width, CV_8UC3);
-    unsigned char *pout = out.ptr(0);
-    for (int i = 0, ii = 0; i < height * width; i++) {
-        pout[ii++] = (unsigned char)(rr[i] / ww[i]);
-        pout[ii++] = (unsigned char)(gg[i] / ww[i]);
-        pout[ii++] = (unsigned char)(bb[i] / ww[i]);
+
+    for (int i = 0; i < height; i++) {
+        std::fill(row.begin(), row.end(), Acc(0));
+
+        for (int k = 0; k < footprints.size(); k++) {
+            Footprint<Acc>& fp = footprints[k];
+            if (i < fp.y0 || i >= fp.y0 + fp.height) continue;
+
+            const Acc *src = fp.at(i, fp.x0);
+            Acc *dst = &row[4 * fp.x0];
+            for (int j = 0; j < 4 * fp.width; j++) {
+                dst[j] += src[j];
+            }
+        }
+
+        unsigned char *pout = out.ptr(i);
+        for (int j = 0; j < width; j++) {
+            const Acc *px = &row[4 * j];
+            const double w = px[3] + eps;
+            *pout++ = (unsigned char)(px[0] / w);
+            *pout++ = (unsigned char)(px[1] / w);
+            *pout++ = (unsigned char)(px[2] / w);
+        }
     }
     imwrite(name, out);
+}
+
+void render(const vector<Mat>& images, const vector<Homography>& homographies,
+            const char *name, const string& accumulator)
+{
+    if (accumulator == "double") {
+        renderSplat<double>(images, homographies, name);
+    } else if (accumulator == "fixed") {
+        renderSplat<uint32_t>(images, homographies, name);
+    } else { // accumulator == "float"
+        renderSplat<float>(images, homographies, name);
+    }
+}
 
-    delete rr;
-    delete gg;
-    delete bb;
-    delete ww;
+// size of the canvas tiles rendered by renderInverse()
+static const int TILE_WIDTH  = 128;
+static const int TILE_HEIGHT = 32;
+
+// number of canvas rows that renderInverse() keeps in memory for a streamed output
+static const int STRIP_HEIGHT = 8 * TILE_HEIGHT;
+
+static bool hasExtension(const char *name, const char *extension)
+{
+    const size_t length = strlen(name);
+    const size_t ext_length = strlen(extension);
+
+    return length >= ext_length && strcasecmp(name + length - ext_length, extension) == 0;
+}
+
+/**
+ * Source image of the inverse renderer together with the homography that maps
+ * canvas pixels into the image
+ */
+struct WarpSource
+{
+    const Mat* image;
+    Homography H;   // canvas -> image
+    int x0, y0;     // bounding box of the image on the canvas,
+    int x1, y1;     // outside of it the image has no weight
+};
+
+/**
+ * Size of the canvas that holds all transformed images, and the sources of the
+ * inverse mapping renderers
+ */
+static void setupCanvas(const vector<Mat>& images, const vector<Homography>& homographies,
+                        int& width, int& height, vector<WarpSource>& sources)
+{
+    // sizes
+    double xmin = images[0].cols;
+    double xmax = 0.;
+    double ymin = images[0].rows;
+    double ymax = 0.;
+
+    for (int k = 0; k < images.size(); k++) {
+        extendBounds(homographies[k], images[k].rows, images[k].cols, xmin, xmax, ymin, ymax);
+    }
+
+    double shifty = -ymin + 2.5;
+    double shiftx = -xmin + 2.5;
+    height = (int)(ymax - ymin + 5.);
+    width = (int)(xmax - xmin + 5.);
+
+    // canvas -> image homographies: undo the shift, then the inverse homography
+    Homography shift;
+    shift.h[2] = -shiftx;
+    shift.h[5] = -shifty;
+
+    sources.resize(images.size());
+    for (int k = 0; k < images.size(); k++) {
+        sources[k].image = &images[k];
+        sources[k].H     = homographies[k].inv() * shift;
+
+        double fxmin = numeric_limits<double>::max();
+        double fxmax = -fxmin;
+        double fymin = fxmin;
+        double fymax = fxmax;
+        extendBounds(homographies[k], images[k].rows, images[k].cols, fxmin, fxmax, fymin, fymax);
+
+        sources[k].x0 = (int)(fxmin + shiftx);
+        sources[k].y0 = (int)(fymin + shifty);
+        sources[k].x1 = (int)(fxmax + shiftx) + 2;
+        sources[k].y1 = (int)(fymax + shifty) + 2;
+    }
+}
+
+/**
+ * Accumulates the bilinear samples of a source image for a segment of a canvas
+ * row, weighted by the distance to the image border (see get_weight()).
+ *
+ * The source coordinates are evaluated incrementally along the row (see
+ * Homography::transformRow()). The coordinate loop is branch-free over the
+ * segment so the compiler can vectorize it. The weights come from the lookup
+ * table and the texel fetch is a scalar gather.
+ */
+static inline void accumulateSegment(const WarpSource& src, int row, int col, int n,
+                                     float *acc_b, float *acc_g, float *acc_r, float *acc_w)
+{
+    const Mat& image = *src.image;
+
+    const float max_x = image.cols - 1;
+    const float max_y = image.rows - 1;
+
+    double sx[TILE_WIDTH];
+    double sy[TILE_WIDTH];
+    float  gw[TILE_WIDTH];
+
+    src.H.transformRow(col, row, n, sx, sy);
+
+    for (int i = 0; i < n; i++) {
+        const float x = sx[i];
+        const float y = sy[i];
+        const float dist = std::min(std::min(x, max_x - x), std::min(y, max_y - y));
+        gw[i] = (dist >= 0.f) ? border_weights(dist) : 0.f;
+    }
+
+    const int step = image.step;
+
+    for (int i = 0; i < n; i++) {
+        if (gw[i] == 0.f) continue;
+
+        const int x0 = std::min((int) sx[i], image.cols - 2);
+        const int y0 = std::min((int) sy[i], image.rows - 2);
+        const float fx = sx[i] - x0;
+        const float fy = sy[i] - y0;
+
+        const unsigned char *p0 = image.ptr(y0) + x0 * 3;
+        const unsigned char *p1 = p0 + step;
+
+        const float w00 = (1.f - fx) * (1.f - fy) * gw[i];
+        const float w01 = fx         * (1.f - fy) * gw[i];
+        const float w10 = (1.f - fx) * fy         * gw[i];
+        const float w11 = fx         * fy         * gw[i];
+
+        acc_b[i] += p0[0] * w00 + p0[3] * w01 + p1[0] * w10 + p1[3] * w11;
+        acc_g[i] += p0[1] * w00 + p0[4] * w01 + p1[1] * w10 + p1[4] * w11;
+        acc_r[i] += p0[2] * w00 + p0[5] * w01 + p1[2] * w10 + p1[5] * w11;
+        acc_w[i] += gw[i];
+    }
+}
+
+/**
+ * Renders the panorama by inverse mapping: every canvas pixel is mapped back
+ * into both source images and the bilinear samples are blended with the same
+ * border weights as in render(). The canvas is split into tiles that are
+ * rendered in parallel. Apart from the output image nothing is allocated.
+ */
+void renderInverse(const vector<Mat>& images, const vector<Homography>& homographies,
+                   const char *name, const int num_threads)
+{
+    int width, height;
+    vector<WarpSource> sources;
+    setupCanvas(images, homographies, width, height, sources);
+
+    // A PPM output is streamed strip by strip, any other format is encoded by
+    // imwrite() and needs the whole canvas.
+    const bool stream = hasExtension(name, ".ppm");
+
+    Mat out;
+    PPMStripWriter writer;
+
+    if (stream) {
+        if (!writer.open(name, width, height)) {
+            cerr << "Can not write " << name << endl;
+            return;
+        }
+        out.create(std::min(STRIP_HEIGHT, height), width, CV_8UC3);
+    } else {
+        out.create(height, width, CV_8UC3);
+    }
+
+    const int tiles_x = (width + TILE_WIDTH - 1) / TILE_WIDTH;
+    vector<const WarpSource*> strip_sources;
+
+    for (int strip_begin = 0; strip_begin < height; strip_begin += STRIP_HEIGHT) {
+        const int strip_end = std::min(strip_begin + STRIP_HEIGHT, height);
+        const int tiles_y   = (strip_end - strip_begin + TILE_HEIGHT - 1) / TILE_HEIGHT;
+
+        // rows of the strip in the output buffer
+        const int out_offset = stream ? strip_begin : 0;
+
+        // images that touch the strip
+        strip_sources.clear();
+        for (int s = 0; s < sources.size(); s++) {
+            if (sources[s].y0 < strip_end && sources[s].y1 > strip_begin) {
+                strip_sources.push_back(&sources[s]);
+            }
+        }
+
+        parallelFor(tiles_x * tiles_y, num_threads, [&](const int tile) {
+            const int col = (tile % tiles_x) * TILE_WIDTH;
+            const int n   = std::min(TILE_WIDTH, width - col);
+
+            const int row_begin = strip_begin + (tile / tiles_x) * TILE_HEIGHT;
+            const int row_end   = std::min(row_begin + TILE_HEIGHT, strip_end);
+
+            float acc_b[TILE_WIDTH];
+            float acc_g[TILE_WIDTH];
+            float acc_r[TILE_WIDTH];
+            float acc_w[TILE_WIDTH];
+
+            for (int row = row_begin; row < row_end; row++) {
+                for (int i = 0; i < n; i++) {
+                    acc_b[i] = acc_g[i] = acc_r[i] = 0.f;
+                    acc_w[i] = 0.001f;
+                }
+
+                for (int s = 0; s < strip_sources.size(); s++) {
+                    const WarpSource& src = *strip_sources[s];
+                    if (row < src.y0 || row >= src.y1) continue;
+
+                    // clip the segment to the bounding box of the image
+                    const int begin = std::max(col, src.x0);
+                    const int end   = std::min(col + n, src.x1);
+                    if (begin >= end) continue;
+
+                    const int i = begin - col;
+                    accumulateSegment(src, row, begin, end - begin,
+                                      acc_b + i, acc_g + i, acc_r + i, acc_w + i);
+                }
+
+                unsigned char *pout = out.ptr(row - out_offset) + col * 3;
+                for (int i = 0; i < n; i++) {
+                    *pout++ = (unsigned char)(acc_b[i] / acc_w[i]);
+                    *pout++ = (unsigned char)(acc_g[i] / acc_w[i]);
+                    *pout++ = (unsigned char)(acc_r[i] / acc_w[i]);
+                }
+            }
+        });
+
+        if (stream) {
+            writer.write(out.rowRange(0, strip_end - strip_begin));
+        }
+    }
+
+    if (!stream) {
+        imwrite(name, out);
+    }
+}
+
+// number of frequency bands of renderMultiBand()
+static const int BANDS = 5;
+
+// label of canvas pixels that are not covered by any image
+static const unsigned char NO_LABEL = 255;
+
+// number of canvas rows that renderMultiBand() blends at a time
+static const int BAND_STRIP_HEIGHT = 16 * TILE_HEIGHT;
+
+// Rows above and below a strip that are blended with it. The 5-tap filters of
+// the pyramid reach 2 * (2^(BANDS-1) - 1) canvas rows down the pyramid and as
+// many back up, so the rows of the strip do not depend on the cut at the
+// border and are identical to blending the whole canvas.
+static const int BAND_STRIP_BORDER = 2 << BANDS;
+
+/**
+ * Assigns every canvas pixel to the image with the highest border weight
+ * there (see BorderWeights), NO_LABEL if no image covers it. Every image is
+ * blended with the pixels of its label as mask.
+ *
+ * @param labels      Output, rows first_row ... first_row + labels.rows of
+ *                    the canvas
+ * @param first_row
+ */
+static void labelCanvas(const vector<WarpSource>& sources, Mat& labels, const int first_row,
+                        const int num_threads)
+{
+    const int tiles = (labels.rows + TILE_HEIGHT - 1) / TILE_HEIGHT;
+
+    parallelFor(tiles, num_threads, [&](const int tile) {
+        vector<float>  best(labels.cols);
+        vector<double> sx(labels.cols);
+        vector<double> sy(labels.cols);
+
+        const int row_end = first_row + std::min((tile + 1) * TILE_HEIGHT, labels.rows);
+
+        for (int row = first_row + tile * TILE_HEIGHT; row < row_end; row++) {
+            unsigned char *label = labels.ptr(row - first_row);
+            std::fill(label, label + labels.cols, NO_LABEL);
+            std::fill(best.begin(), best.end(), 0.f);
+
+            for (int s = 0; s < sources.size(); s++) {
+                const WarpSource& src = sources[s];
+                if (row < src.y0 || row >= src.y1) continue;
+
+                const int begin = std::max(src.x0, 0);
+                const int end   = std::min(src.x1, labels.cols);
+                if (begin >= end) continue;
+
+                const float max_x = src.image->cols - 1;
+                const float max_y = src.image->rows - 1;
+
+                src.H.transformRow(begin, row, end - begin, &sx[0], &sy[0]);
+
+                for (int i = 0; i < end - begin; i++) {
+                    const float x = sx[i];
+                    const float y = sy[i];
+                    const float dist = std::min(std::min(x, max_x - x), std::min(y, max_y - y));
+                    if (dist < 0.f) continue;
+
+                    const float w = border_weights(dist);
+                    if (w > best[begin + i]) {
+                        best[begin + i]  = w;
+                        label[begin + i] = s;
+                    }
+                }
+            }
+        }
+    });
+}
+
+/**
+ * One level down the Gaussian pyramid: the 5-tap binomial filter followed by
+ * decimation, borders are replicated. The images have CN interleaved float
+ * channels. The rows of dst are filtered in tiles in parallel.
+ */
+template<int CN>
+static void pyramidDown(const Mat& src, Mat& dst, const int num_threads)
+{
+    dst.create(src.rows / 2, src.cols / 2, CV_MAKETYPE(CV_32F, CN));
+
+    const int tiles = (dst.rows + TILE_HEIGHT - 1) / TILE_HEIGHT;
+
+    parallelFor(tiles, num_threads, [&](const int tile) {
+        // vertically filtered source row
+        vector<float> column(src.cols * CN);
+
+        const int row_end = std::min((tile + 1) * TILE_HEIGHT, dst.rows);
+
+        for (int row = tile * TILE_HEIGHT; row < row_end; row++) {
+            const float *r[5];
+            for (int k = 0; k < 5; k++) {
+                r[k] = src.ptr<float>(std::min(std::max(2 * row + k - 2, 0), src.rows - 1));
+            }
+            for (int j = 0; j < src.cols * CN; j++) {
+                column[j] = (r[0][j] + r[4][j] + 4.f * (r[1][j] + r[3][j]) + 6.f * r[2][j]) * (1.f / 16.f);
+            }
+
+            float *out = dst.ptr<float>(row);
+            for (int x = 0; x < dst.cols; x++) {
+                const int xm2 = std::max(2 * x - 2, 0) * CN;
+                const int xm1 = std::max(2 * x - 1, 0) * CN;
+                const int xp1 = std::min(2 * x + 1, src.cols - 1) * CN;
+                const int xp2 = std::min(2 * x + 2, src.cols - 1) * CN;
+                const float *c = &column[2 * x * CN];
+
+                for (int ch = 0; ch < CN; ch++) {
+                    out[x * CN + ch] = (column[xm2 + ch] + column[xp2 + ch]
+                                        + 4.f * (column[xm1 + ch] + column[xp1 + ch])
+                                        + 6.f * c[ch]) * (1.f / 16.f);
+                }
+            }
+        }
+    });
+}
+
+/**
+ * Row y of the image src upsampled to twice its size (the inverse of
+ * pyramidDown()).
+ *
+ * @param tmp  buffer of src.cols * CN floats
+ * @param out  Output, 2 * src.cols * CN floats
+ */
+template<int CN>
+static void upsampleRow(const Mat& src, const int y, float *tmp, float *out)
+{
+    const int i = y / 2;
+    const float *r0 = src.ptr<float>(std::max(i - (y % 2 == 0), 0));
+    const float *r1 = src.ptr<float>(i);
+    const float *r2 = src.ptr<float>(std::min(i + 1, src.rows - 1));
+
+    if (y % 2 == 0) {
+        for (int j = 0; j < src.cols * CN; j++) {
+            tmp[j] = (r0[j] + 6.f * r1[j] + r2[j]) * (1.f / 8.f);
+        }
+    } else {
+        for (int j = 0; j < src.cols * CN; j++) {
+            tmp[j] = (r1[j] + r2[j]) * 0.5f;
+        }
+    }
+
+    for (int x = 0; x < src.cols; x++) {
+        const float *left  = &tmp[std::max(x - 1, 0) * CN];
+        const float *mid   = &tmp[x * CN];
+        const float *right = &tmp[std::min(x + 1, src.cols - 1) * CN];
+
+        for (int ch = 0; ch < CN; ch++) {
+            out[2 * x * CN + ch]       = (left[ch] + 6.f * mid[ch] + right[ch]) * (1.f / 8.f);
+            out[(2 * x + 1) * CN + ch] = (mid[ch] + right[ch]) * 0.5f;
+        }
+    }
+}
+
+/**
+ * Adds the band of an image to the blended pyramid level:
+ * blend += (gauss - upsample(next)) * mask, and the mask to the sum of the
+ * weights. The last level has no next level and adds the Gaussian directly.
+ *
+ * @param gauss  Gaussian level of the image: b, g, r, coverage
+ * @param next   next coarser Gaussian level, empty for the last level
+ * @param mask   Gaussian level of the mask of the image
+ * @param blend  blended level of the canvas: b, g, r, weight
+ * @param x0     position of the image level in the canvas level
+ * @param y0
+ */
+static void accumulateBand(const Mat& gauss, const Mat& next, const Mat& mask, Mat& blend,
+                           const int x0, const int y0, const int num_threads)
+{
+    const int tiles = (gauss.rows + TILE_HEIGHT - 1) / TILE_HEIGHT;
+
+    parallelFor(tiles, num_threads, [&](const int tile) {
+        vector<float> tmp(4 * next.cols);
+        vector<float> up(4 * gauss.cols, 0.f);
+
+        const int row_end = std::min((tile + 1) * TILE_HEIGHT, gauss.rows);
+
+        for (int row = tile * TILE_HEIGHT; row < row_end; row++) {
+            if (!next.empty()) {
+                upsampleRow<4>(next, row, &tmp[0], &up[0]);
+            }
+
+            const float *g = gauss.ptr<float>(row);
+            const float *m = mask.ptr<float>(row);
+            float *b = blend.ptr<float>(y0 + row) + 4 * x0;
+
+            for (int x = 0; x < gauss.cols; x++) {
+                b[4 * x + 0] += (g[4 * x + 0] - up[4 * x + 0]) * m[x];
+                b[4 * x + 1] += (g[4 * x + 1] - up[4 * x + 1]) * m[x];
+                b[4 * x + 2] += (g[4 * x + 2] - up[4 * x + 2]) * m[x];
+                b[4 * x + 3] += m[x];
+            }
+        }
+    });
+}
+
+/**
+ * Renders the panorama by multi-band blending (Burt and Adelson 1983). Every
+ * image is mapped onto the canvas over its footprint, split into BANDS
+ * Laplacian bands and every band is blended with a correspondingly smoothed
+ * mask of the image. Low frequencies are blended over a wide overlap and
+ * high frequencies over a narrow one, so there is neither a visible seam nor
+ * ghosting of misaligned details.
+ *
+ * The masks are the canvas labels of labelCanvas(). The canvas is blended in
+ * strips of BAND_STRIP_HEIGHT rows, each with a border of BAND_STRIP_BORDER
+ * rows, so the labels and pyramids only cover one strip at a time. A PPM
+ * output is streamed strip by strip, then the memory does not grow with the
+ * height of the panorama. All pyramid levels are processed in row tiles in
+ * parallel.
+ */
+void renderMultiBand(const vector<Mat>& images, const vector<Homography>& homographies,
+                     const char *name, const int num_threads)
+{
+    if (images.size() >= NO_LABEL) {
+        cerr << "Multi-band blending supports at most " << (int) NO_LABEL - 1 << " images" << endl;
+        return;
+    }
+
+    int width, height;
+    vector<WarpSource> sources;
+    setupCanvas(images, homographies, width, height, sources);
+
+    // every pyramid level of the canvas and of the footprints has exactly
+    // half the size of the level below, so both are aligned to this grid
+    const int align = 1 << (BANDS - 1);
+    const int canvas_width  = (width  + align - 1) / align * align;
+    const int canvas_height = (height + align - 1) / align * align;
+
+    // A PPM output is streamed strip by strip, any other format is encoded by
+    // imwrite() and needs the whole canvas.
+    const bool stream = hasExtension(name, ".ppm");
+
+    Mat out;
+    PPMStripWriter writer;
+
+    if (stream) {
+        if (!writer.open(name, width, height)) {
+            cerr << "Can not write " << name << endl;
+            return;
+        }
+        out.create(std::min(BAND_STRIP_HEIGHT, height), width, CV_8UC3);
+    } else {
+        out.create(height, width, CV_8UC3);
+    }
+
+    Mat labels;
+
+    // blended pyramid of the strip: b, g, r, sum of the weights
+    vector<Mat> blend(BANDS);
+
+    vector<Mat> gauss(BANDS);
+    vector<Mat> mask(BANDS);
+
+    for (int strip_begin = 0; strip_begin < height; strip_begin += BAND_STRIP_HEIGHT) {
+        const int strip_end = std::min(strip_begin + BAND_STRIP_HEIGHT, height);
+
+        // canvas rows that are blended for the strip, aligned to the grid
+        const int rows_begin = std::max(strip_begin - BAND_STRIP_BORDER, 0);
+        const int rows_end   = std::min((strip_end + align - 1) / align * align + BAND_STRIP_BORDER,
+                                        canvas_height);
+
+        labels.create(rows_end - rows_begin, canvas_width, CV_8UC1);
+        labelCanvas(sources, labels, rows_begin, num_threads);
+
+        for (int l = 0; l < BANDS; l++) {
+            blend[l].create(labels.rows >> l, canvas_width >> l, CV_32FC4);
+            blend[l].setTo(Scalar::all(0));
+        }
+
+        for (int k = 0; k < sources.size(); k++) {
+            const WarpSource& src = sources[k];
+            const Mat& image = *src.image;
+
+            // footprint of the image, aligned and clipped to the rows
+            const int x0 = std::max(src.x0, 0) / align * align;
+            const int y0 = std::max(std::max(src.y0, 0) / align * align, rows_begin);
+            const int x1 = std::min((src.x1 + align - 1) / align * align, canvas_width);
+            const int y1 = std::min((src.y1 + align - 1) / align * align, rows_end);
+            if (x0 >= x1 || y0 >= y1) continue;
+
+            // the image on the canvas with its coverage (b, g, r, 1), and its mask
+            gauss[0].create(y1 - y0, x1 - x0, CV_32FC4);
+            mask[0].create(y1 - y0, x1 - x0, CV_32FC1);
+
+            const int tiles = (y1 - y0 + TILE_HEIGHT - 1) / TILE_HEIGHT;
+
+            parallelFor(tiles, num_threads, [&](const int tile) {
+                vector<double> sx(x1 - x0);
+                vector<double> sy(x1 - x0);
+
+                const int row_end = std::min(y0 + (tile + 1) * TILE_HEIGHT, y1);
+
+                for (int row = y0 + tile * TILE_HEIGHT; row < row_end; row++) {
+                    float *g = gauss[0].ptr<float>(row - y0);
+                    float *m = mask[0].ptr<float>(row - y0);
+                    const unsigned char *label = labels.ptr(row - rows_begin) + x0;
+
+                    src.H.transformRow(x0, row, x1 - x0, &sx[0], &sy[0]);
+
+                    for (int i = 0; i < x1 - x0; i++, g += 4) {
+                        m[i] = (label[i] == k);
+
+                        if (sx[i] < 0. || sy[i] < 0. || sx[i] > image.cols - 1 || sy[i] > image.rows - 1) {
+                            g[0] = g[1] = g[2] = g[3] = 0.f;
+                            continue;
+                        }
+
+                        const int px = std::min((int) sx[i], image.cols - 2);
+                        const int py = std::min((int) sy[i], image.rows - 2);
+                        const float fx = sx[i] - px;
+                        const float fy = sy[i] - py;
+
+                        const unsigned char *p0 = image.ptr(py) + px * 3;
+                        const unsigned char *p1 = p0 + image.step;
+
+                        const float w00 = (1.f - fx) * (1.f - fy);
+                        const float w01 = fx         * (1.f - fy);
+                        const float w10 = (1.f - fx) * fy;
+                        const float w11 = fx         * fy;
+
+                        g[0] = p0[0] * w00 + p0[3] * w01 + p1[0] * w10 + p1[3] * w11;
+                        g[1] = p0[1] * w00 + p0[4] * w01 + p1[1] * w10 + p1[4] * w11;
+                        g[2] = p0[2] * w00 + p0[5] * w01 + p1[2] * w10 + p1[5] * w11;
+                        g[3] = 1.f;
+                    }
+                }
+            });
+
+            for (int l = 1; l < BANDS; l++) {
+                pyramidDown<4>(gauss[l - 1], gauss[l], num_threads);
+                pyramidDown<1>(mask[l - 1], mask[l], num_threads);
+            }
+
+            // the colors are smoothed together with the coverage, so dividing by
+            // it extrapolates them beyond the image border instead of fading them
+            // to black
+            for (int l = 0; l < BANDS; l++) {
+                Mat& g = gauss[l];
+                const int level_tiles = (g.rows + TILE_HEIGHT - 1) / TILE_HEIGHT;
+
+                parallelFor(level_tiles, num_threads, [&](const int tile) {
+                    const int row_end = std::min((tile + 1) * TILE_HEIGHT, g.rows);
+
+                    for (int row = tile * TILE_HEIGHT; row < row_end; row++) {
+                        float *p = g.ptr<float>(row);
+                        for (int x = 0; x < g.cols; x++, p += 4) {
+                            const float s = (p[3] > 1e-6f) ? 1.f / p[3] : 0.f;
+                            p[0] *= s;
+                            p[1] *= s;
+                            p[2] *= s;
+                        }
+                    }
+                });
+            }
+
+            for (int l = 0; l < BANDS; l++) {
+                accumulateBand(gauss[l], (l + 1 < BANDS) ? gauss[l + 1] : Mat(), mask[l], blend[l],
+                               x0 >> l, (y0 - rows_begin) >> l, num_threads);
+            }
+        }
+
+        // normalize the bands and collapse the pyramid from the coarsest level
+        for (int l = BANDS - 1; l >= 0; l--) {
+            Mat& level = blend[l];
+            const int tiles = (level.rows + TILE_HEIGHT - 1) / TILE_HEIGHT;
+
+            parallelFor(tiles, num_threads, [&](const int tile) {
+                vector<float> tmp(4 * level.cols / 2);
+                vector<float> up(4 * level.cols, 0.f);
+
+                const int row_end = std::min((tile + 1) * TILE_HEIGHT, level.rows);
+
+                for (int row = tile * TILE_HEIGHT; row < row_end; row++) {
+                    if (l + 1 < BANDS) {
+                        upsampleRow<4>(blend[l + 1], row, &tmp[0], &up[0]);
+                    }
+
+                    float *p = level.ptr<float>(row);
+                    for (int x = 0; x < level.cols; x++, p += 4) {
+                        const float s = 1.f / (p[3] + 1e-6f);
+                        p[0] = p[0] * s + up[4 * x + 0];
+                        p[1] = p[1] * s + up[4 * x + 1];
+                        p[2] = p[2] * s + up[4 * x + 2];
+                    }
+                }
+            });
+        }
+
+        // rows of the strip in the output buffer
+        const int out_offset = stream ? strip_begin : 0;
+
+        for (int row = strip_begin; row < strip_end; row++) {
+            const float *p = blend[0].ptr<float>(row - rows_begin);
+            const unsigned char *label = labels.ptr(row - rows_begin);
+            unsigned char *pout = out.ptr(row - out_offset);
+
+            for (int x = 0; x < width; x++, p += 4) {
+                if (label[x] == NO_LABEL) {
+                    *pout++ = 0;
+                    *pout++ = 0;
+                    *pout++ = 0;
+                    continue;
+                }
+                *pout++ = saturate_cast<unsigned char>(p[0]);
+                *pout++ = saturate_cast<unsigned char>(p[1]);
+                *pout++ = saturate_cast<unsigned char>(p[2]);
+            }
+        }
+
+        if (stream) {
+            writer.write(out.rowRange(0, strip_end - strip_begin));
+        }
+    }
+
+    if (!stream) {
+        imwrite(name, out);
+    }
+}
+
+/**
+ * Bilinear sample of an image at (x, y), which has to lie inside of the image
+ */
+static inline void sampleBilinear(const Mat& image, double x, double y, float bgr[3])
+{
+    const int x0 = std::min((int) x, image.cols - 2);
+    const int y0 = std::min((int) y, image.rows - 2);
+    const float fx = x - x0;
+    const float fy = y - y0;
+
+    const unsigned char *p0 = image.ptr(y0) + x0 * 3;
+    const unsigned char *p1 = p0 + image.step;
+
+    const float w00 = (1.f - fx) * (1.f - fy);
+    const float w01 = fx         * (1.f - fy);
+    const float w10 = (1.f - fx) * fy;
+    const float w11 = fx         * fy;
+
+    for (int c = 0; c < 3; c++) {
+        bgr[c] = p0[c] * w00 + p0[c + 3] * w01 + p1[c] * w10 + p1[c + 3] * w11;
+    }
+}
+
+static inline bool covers(const Mat& image, double x, double y)
+{
+    return x >= 0. && y >= 0. && x <= image.cols - 1 && y <= image.rows - 1;
+}
+
+/**
+ * Assigns every canvas pixel to exactly one image. The images are added one
+ * after another to the composite of the previous ones. In the overlap of an
+ * image with the composite a minimum-cost seam from the top to the bottom
+ * row is searched by dynamic programming over the color differences of both,
+ * and each side of the seam is taken from one of them. Only the rows of the
+ * overlap, between its first and last column, are analyzed.
+ *
+ * The seams run vertically, which assumes that the images are ordered from
+ * left to right or from right to left.
+ *
+ * @param differences  Optional output, the color difference of every canvas
+ *                     pixel in an overlap that the seams are cut through,
+ *                     row major, 0 elsewhere
+ */
+static void seamCanvas(const vector<WarpSource>& sources, Mat& labels, vector<double>* differences)
+{
+    labels.setTo(Scalar::all(NO_LABEL));
+
+    vector<double> sx(labels.cols);
+    vector<double> sy(labels.cols);
+
+    for (int k = 0; k < sources.size(); k++) {
+        const WarpSource& src = sources[k];
+        const Mat& image = *src.image;
+
+        const int x0 = std::max(src.x0, 0);
+        const int x1 = std::min(src.x1, labels.cols);
+        const int y0 = std::max(src.y0, 0);
+        const int y1 = std::min(src.y1, labels.rows);
+        if (x0 >= x1 || y0 >= y1) continue;
+
+        // columns [span_begin, span_end) of every row from the first to the
+        // last pixel that is covered by the image and the composite. The
+        // source coordinates of the span pixels are kept, so the seam passes
+        // decide the coverage exactly as this one. offsets[r] is the first
+        // pixel of row r in span_x and span_y.
+        vector<int> span_begin(y1 - y0, 0);
+        vector<int> span_end(y1 - y0, 0);
+        vector<int> offsets(y1 - y0 + 1, 0);
+        vector<double> span_x;
+        vector<double> span_y;
+        double overlap_center = 0.;
+        int overlap_rows = 0;
+
+        for (int row = y0; row < y1; row++) {
+            unsigned char *label = labels.ptr(row);
+            int& begin = span_begin[row - y0];
+            int& end   = span_end[row - y0];
+
+            src.H.transformRow(x0, row, x1 - x0, &sx[0], &sy[0]);
+
+            begin = x1;
+            end   = x0;
+            for (int i = 0; i < x1 - x0; i++) {
+                if (!covers(image, sx[i], sy[i])) continue;
+
+                if (label[x0 + i] == NO_LABEL) {
+                    label[x0 + i] = k;
+                } else {
+                    begin = std::min(begin, x0 + i);
+                    end   = x0 + i + 1;
+                }
+            }
+
+            if (begin < end) {
+                overlap_center += 0.5 * (begin + end);
+                overlap_rows++;
+
+                span_x.insert(span_x.end(), sx.begin() + (begin - x0), sx.begin() + (end - x0));
+                span_y.insert(span_y.end(), sy.begin() + (begin - x0), sy.begin() + (end - x0));
+            }
+            offsets[row - y0 + 1] = span_x.size();
+        }
+
+        if (overlap_rows == 0) continue;
+
+        // the image takes the side of the seam that is closer to its center
+        const bool image_right = 0.5 * (src.x0 + src.x1) > overlap_center / overlap_rows;
+
+        // dynamic programming from the top to the bottom row: cost of the
+        // cheapest seam that ends in a pixel of the span, and the column of
+        // its predecessor in the row above
+        vector<float> cost(offsets.back());
+        vector<int> previous(offsets.back());
+
+        int last = -1; // last row of the overlap
+
+        for (int row = y0; row < y1; row++) {
+            const int r = row - y0;
+            const int begin = span_begin[r];
+            const int end   = span_end[r];
+            if (begin >= end) {
+                continue;
+            }
+
+            const unsigned char *label = labels.ptr(row);
+            float *c = &cost[offsets[r]];
+            int *p = &previous[offsets[r]];
+            const double *xs = &span_x[offsets[r]];
+            const double *ys = &span_y[offsets[r]];
+
+            for (int col = begin; col < end; col++) {
+                const double x = xs[col - begin];
+                const double y = ys[col - begin];
+                double ox, oy;
+
+                // the color difference of both, zero where only one of them covers the pixel
+                float diff = 0.f;
+                if (covers(image, x, y) && label[col] != k) {
+                    const WarpSource& other = sources[label[col]];
+                    other.H.apply(col, row, &ox, &oy);
+
+                    float a[3], b[3];
+                    sampleBilinear(image, x, y, a);
+                    sampleBilinear(*other.image, ox, oy, b);
+                    diff = fabs(a[0] - b[0]) + fabs(a[1] - b[1]) + fabs(a[2] - b[2]);
+
+                    if (differences != NULL) {
+                        (*differences)[row * labels.cols + col] = diff;
+                    }
+                }
+
+                // the seam continues from one of the three pixels above,
+                // clipped to the span of the row above
+                float best = 0.f;
+                int best_col = -1;
+                if (last >= 0) {
+                    const int lr = last - y0;
+                    const int lo = std::min(std::max(col - 1, span_begin[lr]), span_end[lr] - 1);
+                    const int hi = std::min(std::max(col + 1, span_begin[lr]), span_end[lr] - 1);
+                    const int lc = offsets[lr] - span_begin[lr]; // cost[lc + j] is column j
+
+                    best_col = lo;
+                    for (int j = lo + 1; j <= hi; j++) {
+                        if (cost[lc + j] < cost[lc + best_col]) best_col = j;
+                    }
+                    best = cost[lc + best_col];
+                }
+
+                c[col - begin] = diff + best;
+                p[col - begin] = best_col;
+            }
+            last = row;
+        }
+
+        // trace the seam back from its cheapest end and assign the pixels of
+        // the spans to the side they are on
+        int seam = span_begin[last - y0];
+        {
+            const float *c = &cost[offsets[last - y0]];
+            for (int col = seam + 1; col < span_end[last - y0]; col++) {
+                if (c[col - span_begin[last - y0]] < c[seam - span_begin[last - y0]]) seam = col;
+            }
+        }
+
+        for (int row = last; row >= y0 && seam >= 0; row--) {
+            const int r = row - y0;
+            const int begin = span_begin[r];
+            const int end   = span_end[r];
+            if (begin >= end) continue;
+
+            unsigned char *label = labels.ptr(row);
+            const double *xs = &span_x[offsets[r]];
+            const double *ys = &span_y[offsets[r]];
+
+            for (int col = begin; col < end; col++) {
+                const bool right = col >= seam;
+                if (right == image_right && covers(image, xs[col - begin], ys[col - begin])) {
+                    label[col] = k;
+                }
+            }
+
+            seam = previous[offsets[r] + seam - begin];
+        }
+    }
+}
+
+/**
+ * Renders the panorama by seam-cut compositing: every canvas pixel is
+ * sampled from the single image it is assigned to by seamCanvas(), so
+ * misaligned details are not ghosted. The canvas is rendered in row tiles in
+ * parallel.
+ *
+ * @param debug  If enabled, the color differences in the overlaps are written
+ *               to seam-differences.png
+ */
+void renderSeam(const vector<Mat>& images, const vector<Homography>& homographies,
+                const char *name, const int num_threads, DebugWriter& debug)
+{
+    if (images.size() >= NO_LABEL) {
+        cerr << "Seam-cut compositing supports at most " << (int) NO_LABEL - 1 << " images" << endl;
+        return;
+    }
+
+    int width, height;
+    vector<WarpSource> sources;
+    setupCanvas(images, homographies, width, height, sources);
+
+    Mat labels(height, width, CV_8UC1);
+
+    if (debug.enabled()) {
+        vector<double> differences(height * width, 0.);
+        seamCanvas(sources, labels, &differences);
+        save_double_as_image(height, width, &differences[0], "seam-differences.png", &debug);
+    } else {
+        seamCanvas(sources, labels, NULL);
+    }
+
+    Mat out(height, width, CV_8UC3, Scalar::all(0));
+
+    const int tiles = (height + TILE_HEIGHT - 1) / TILE_HEIGHT;
+
+    parallelFor(tiles, num_threads, [&](const int tile) {
+        vector<double> sx(width);
+        vector<double> sy(width);
+
+        const int row_end = std::min((tile + 1) * TILE_HEIGHT, height);
+
+        for (int row = tile * TILE_HEIGHT; row < row_end; row++) {
+            const unsigned char *label = labels.ptr(row);
+            unsigned char *pout = out.ptr(row);
+
+            for (int s = 0; s < sources.size(); s++) {
+                const WarpSource& src = sources[s];
+                if (row < src.y0 || row >= src.y1) continue;
+
+                const int begin = std::max(src.x0, 0);
+                const int end   = std::min(src.x1, width);
+                if (begin >= end) continue;
+
+                src.H.transformRow(begin, row, end - begin, &sx[0], &sy[0]);
+
+                for (int col = begin; col < end; col++) {
+                    if (label[col] != s) continue;
+
+                    float bgr[3];
+                    sampleBilinear(*src.image, sx[col - begin], sy[col - begin], bgr);
+                    pout[3 * col + 0] = (unsigned char) bgr[0];
+                    pout[3 * col + 1] = (unsigned char) bgr[1];
+                    pout[3 * col + 2] = (unsigned char) bgr[2];
+                }
+            }
+        }
+    });
+
+    imwrite(name, out);
 }
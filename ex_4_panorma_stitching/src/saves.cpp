@@ -4,6 +4,8 @@
 #include <stdlib.h>
 #include <time.h>
 #include <fstream>
+#include <algorithm>
+#include <cmath>
 
 // opencv
 #include <opencv2/core/core.hpp>
@@ -15,51 +17,124 @@
 using namespace std;
 using namespace cv;
 
-void save_double_as_image(int height, int width, double *array, const char *name)
+/**
+ * Writes an image in one of the fast formats of the debug output:
+ *   "png" - PNG with the lowest compression level
+ *   "ppm" - uncompressed binary PPM (color) or PGM (gray). The extension of
+ *           the filename is replaced.
+ */
+bool writeImage(const string& filename, const Mat& image, const string& format)
 {
+    vector<int> params;
+
+    if (format == "ppm") {
+        params.push_back(CV_IMWRITE_PXM_BINARY);
+        params.push_back(1);
+
+        const size_t dot = filename.find_last_of('.');
+        const string base = (dot == string::npos) ? filename : filename.substr(0, dot);
+        return imwrite(base + (image.channels() == 1 ? ".pgm" : ".ppm"), image, params);
+    }
+
+    params.push_back(CV_IMWRITE_PNG_COMPRESSION);
+    params.push_back(1);
+    return imwrite(filename, image, params);
+}
+
+
+/**
+ * out[i] = saturate(array[i] * scale + offset). The loop has no branches, so
+ * the compiler vectorizes it.
+ */
+static void convertScaled(const double *array, const int n, const double scale, const double offset,
+                          unsigned char *out)
+{
+    for (int i = 0; i < n; i++) {
+        const double v = std::min(std::max(array[i] * scale + offset, 0.), 255.);
+        out[i] = (unsigned char) v;
+    }
+}
+
+
+/**
+ * Converts a double array to an 8 bit image and writes it. The statistics
+ * are gathered in a single pass with independent accumulators, the
+ * conversion is a second vectorized pass.
+ *
+ * @param writer  If set, the image is encoded on its background thread in
+ *                its format, otherwise it is written as PNG right away
+ */
+void save_double_as_image(int height, int width, const double *array, const char *name, DebugWriter *writer)
+{
+    const int n = height * width;
+    if (n == 0) {
+        return;
+    }
+
+    double scale, offset;
 
     #ifdef RESCALE_MINMAX
 
-        double min = array[0];
-        double max = array[0];
-        for (int i = 1; i < height * width; i++) {
-            if (array[i] > max) max = array[i];
-            if (array[i] < min) min = array[i];
+        // [min, max] -> [0, 255]
+        double min[4] = { array[0], array[0], array[0], array[0] };
+        double max[4] = { array[0], array[0], array[0], array[0] };
+
+        int i = 0;
+        for (; i + 4 <= n; i += 4) {
+            for (int k = 0; k < 4; k++) {
+                min[k] = std::min(min[k], array[i + k]);
+                max[k] = std::max(max[k], array[i + k]);
+            }
+        }
+        for (; i < n; i++) {
+            min[0] = std::min(min[0], array[i]);
+            max[0] = std::max(max[0], array[i]);
         }
+        min[0] = std::min(std::min(min[0], min[1]), std::min(min[2], min[3]));
+        max[0] = std::max(std::max(max[0], max[1]), std::max(max[2], max[3]));
 
-        Mat A(height, width, CV_8UC1);
-        unsigned char *img = A.ptr(0);
-        for (int i = 0; i < height * width; i++)
-            img[i] = (unsigned char)((array[i] - min) * 255. / (max - min) + 0.5);
-        imwrite(name, A);
+        scale  = (max[0] > min[0]) ? 255. / (max[0] - min[0]) : 0.;
+        offset = 0.5 - min[0] * scale;
 
     #else
 
-        double mean = 0.;
-        double var = 0.;
-        for (int i = 1; i < height * width; i++) {
-            mean += array[i];
-            var += array[i] * array[i];
+        // mean -> 128, standard deviation -> 127
+        double sum[2] = { 0., 0. };
+        double squares[2] = { 0., 0. };
+
+        int i = 0;
+        for (; i + 2 <= n; i += 2) {
+            sum[0] += array[i];
+            sum[1] += array[i + 1];
+            squares[0] += array[i] * array[i];
+            squares[1] += array[i + 1] * array[i + 1];
         }
-        mean /= height * width;
-        var = sqrt(var / (height * width) - mean * mean);
-
-        Mat A(height, width, CV_8UC1);
-        unsigned char *img = A.ptr(0);
-        for (int i = 0; i < height * width; i++) {
-            double tmp = 128. + (array[i] - mean) / var * 127. + 0.5;
-            if (tmp < 0.) tmp = 0.;
-            if (tmp > 255.) tmp = 255.;
-            img[i] = (unsigned char)tmp;
+        for (; i < n; i++) {
+            sum[0] += array[i];
+            squares[0] += array[i] * array[i];
         }
-        imwrite(name, A);
+
+        const double mean = (sum[0] + sum[1]) / n;
+        const double var = sqrt((squares[0] + squares[1]) / n - mean * mean);
+
+        scale  = (var > 0.) ? 127. / var : 0.;
+        offset = 128.5 - mean * scale;
 
     #endif
 
+    Mat A(height, width, CV_8UC1);
+    convertScaled(array, n, scale, offset, A.ptr(0));
+
+    if (writer != NULL) {
+        writer->write(name, A);
+    } else {
+        writeImage(name, A, "png");
+    }
 }
 
 
-void save_keypoints_as_image(const Mat& image, const vector<KeyPoint>& keypoints, const char* filename)
+void save_keypoints_as_image(const Mat& image, const vector<KeyPoint>& keypoints, const char* filename,
+                             const string& format)
 {
     Mat out;
     Scalar color = { 255, 0, 0 };
@@ -67,5 +142,118 @@ void save_keypoints_as_image(const Mat& image, const vector<KeyPoint>& keypoints
     drawKeypoints(image, keypoints, out, color, DrawMatchesFlags::DRAW_RICH_KEYPOINTS);
 
     // store image
-    imwrite(filename, out);
-}
\ No newline at end of file
+    writeImage(filename, out, format);
+}
+
+
+DebugWriter::DebugWriter(const bool enabled, const string& format)
+    : active(enabled), finished(false), image_format(format)
+{
+    if (active) {
+        worker = std::thread(&DebugWriter::run, this);
+    }
+}
+
+
+DebugWriter::~DebugWriter()
+{
+    if (active) {
+        {
+            lock_guard<std::mutex> lock(mutex);
+            finished = true;
+        }
+        wakeup.notify_one();
+        worker.join();
+    }
+}
+
+
+void DebugWriter::submit(const function<void()>& job)
+{
+    if (!active) {
+        return;
+    }
+
+    {
+        lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(job);
+    }
+    wakeup.notify_one();
+}
+
+
+/**
+ * Encodes the image on the background thread. The image is shared, not
+ * copied, so it must not be modified afterwards.
+ */
+void DebugWriter::write(const string& filename, const Mat& image)
+{
+    const string format = image_format;
+    submit([=]() {
+        writeImage(filename, image, format);
+    });
+}
+
+
+/**
+ * Background thread: runs the jobs in the order they were submitted until the
+ * writer is destroyed and the queue is empty
+ */
+void DebugWriter::run()
+{
+    while (true) {
+        function<void()> job;
+        {
+            unique_lock<std::mutex> lock(mutex);
+            wakeup.wait(lock, [this]() { return finished || !jobs.empty(); });
+
+            if (jobs.empty()) {
+                return;
+            }
+            job = jobs.front();
+            jobs.pop_front();
+        }
+        job();
+    }
+}
+
+
+bool PPMStripWriter::open(const char *filename, int width, int height)
+{
+    close();
+
+    file = fopen(filename, "wb");
+    if (file == NULL) {
+        return false;
+    }
+
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+    row.resize(3 * width);
+
+    return true;
+}
+
+
+void PPMStripWriter::write(const Mat& strip)
+{
+    for (int i = 0; i < strip.rows; i++) {
+        const unsigned char *bgr = strip.ptr(i);
+
+        // PPM stores RGB
+        for (int j = 0; j < 3 * strip.cols; j += 3) {
+            row[j + 0] = bgr[j + 2];
+            row[j + 1] = bgr[j + 1];
+            row[j + 2] = bgr[j + 0];
+        }
+        fwrite(&row[0], 1, 3 * strip.cols, file);
+    }
+}
+
+
+void PPMStripWriter::close()
+{
+    if (file != NULL) {
+        fclose(file);
+        file = NULL;
+    }
+}
@@ -0,0 +1,84 @@
+#include <iostream>
+#include <vector>
+#include <cmath>
+#include <opencv2/core/core.hpp>
+
+#include "panorama.hpp"
+
+using namespace std;
+using namespace cv;
+
+/**
+ * Checks of the homography estimation. Returns a non-zero exit code if one of
+ * them fails.
+ */
+
+// maximal deviation of two homographies over the points in pixels
+static double maxDeviation(const Homography& A, const Homography& B, const vector<Point2d>& points)
+{
+    double deviation = 0.;
+    for (int i = 0; i < points.size(); i++) {
+        const Point2d a = A(points[i]);
+        const Point2d b = B(points[i]);
+        deviation = max(deviation, hypot(a.x - b.x, a.y - b.y));
+    }
+    return deviation;
+}
+
+// exact correspondences of H on a grid of points
+static void correspondences(const Homography& H, vector<Point2d>& src, vector<Point2d>& dst)
+{
+    for (int y = 0; y <= 600; y += 50) {
+        for (int x = 0; x <= 1000; x += 50) {
+            src.push_back(Point2d(x, y));
+            dst.push_back(H(Point2d(x, y)));
+        }
+    }
+}
+
+// a projective homography that is not scaled to h[8] = 1
+static Homography projective()
+{
+    const Mat H = (Mat_<double>(3, 3) <<  0.9,  0.05,  120.,
+                                         -0.03, 1.02,   15.,
+                                          1e-4, 2e-5,    1.);
+    return Homography(H * 2.5);
+}
+
+static bool check(const char *name, const bool passed)
+{
+    cout << (passed ? "passed: " : "FAILED: ") << name << endl;
+    return passed;
+}
+
+int main()
+{
+    bool passed = true;
+
+    const Homography H = projective();
+    vector<Point2d> src, dst;
+    correspondences(H, src, dst);
+
+    // zero Gauss-Newton steps only rescale the homography
+    {
+        Homography refined = H;
+        refineHomography(&src[0], &dst[0], src.size(), refined, 0);
+        passed &= check("refineHomography() without steps keeps H", maxDeviation(H, refined, src) < 1e-9);
+    }
+
+    // an exact homography is a minimum of the transfer error
+    {
+        Homography refined = H;
+        refineHomography(&src[0], &dst[0], src.size(), refined, 3);
+        passed &= check("refineHomography() keeps an exact H", maxDeviation(H, refined, src) < 1e-9);
+    }
+
+    // RANSAC recovers an exact homography
+    {
+        vector<unsigned char> inliers;
+        const Homography estimated = findHomographyRansac(src, dst, 3., inliers);
+        passed &= check("findHomographyRansac() finds an exact H", maxDeviation(H, estimated, src) < 1e-6);
+    }
+
+    return passed ? 0 : 1;
+}
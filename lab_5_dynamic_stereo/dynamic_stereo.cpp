@@ -1,10 +1,13 @@
 #include <iostream>
-#include <iomanip>  // std::setw
-#include <stack>
-#include <getopt.h> // getopt_long()
-#include <limits>   // numeric_limits
-#include <assert.h> // assert
-#include <tuple>    // std::tuple, std::tie
+#include <getopt.h>    // getopt_long()
+#include <limits>      // numeric_limits
+#include <assert.h>    // assert
+#include <tuple>       // std::tuple, std::tie
+#include <thread>      // std::thread
+#include <atomic>      // std::atomic
+#include <algorithm>   // std::min_element
+#include <type_traits> // std::is_same
+#include <stdint.h>    // uint16_t, uint32_t
 
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
@@ -12,66 +15,27 @@
 using namespace std;
 using namespace cv;
 
-// neat shortcut for node indices representing a none existent
-// node reference
-static const int none = -1;
-int conversion_offset = 0;
-
 // signature of all cost functions
 typedef int (*cost_t)(const int a, const int b);
 
 /**
- * Very simple and small node implementation that is used in used by the Tree
- * class below.
- */
-typedef struct Node
-{
-    int parent;
-    int children[3]; // left, middle, right
-
-    vector<double>* costs;
-
-    // initialize all node indices with none
-    Node() : parent(none), children { none, none, none }, costs(nullptr) { };
-
-    inline int const numChildNodes()
-    {
-        int num = 0;
-
-        if (children[0] != none) { num++; }
-        if (children[1] != none) { num++; }
-        if (children[2] != none) { num++; }
-
-        return num;
-    }
-} Node;
-
-/**
- * A simple class that represents the tree used for the Markov tree. The tree
- * is represented as a list of nodes, where the index of a node is the running
- * number in the matrix:
+ * Implicit representation of the spanning tree used for the Markov tree. The
+ * nodes are the cells of a (rows x cols) grid:
  *
  *     --------------------------
- *     |  0 |  1 |  2 |  3 |  4 |
+ *     | 0,0| 0,1| 0,2| 0,3| 0,4|
  *     --------------------------
- *     |  5 |  6 |  7 |  8 |  9 |
+ *     | 1,0| 1,1| 1,2| 1,3| 1,4|
  *     --------------------------
- *     | 10 | 11 | 12 | 13 | 14 |
+ *     | 2,0| 2,1| 2,2| 2,3| 2,4|
  *     --------------------------
- *     | 15 | 16 | 17 | 18 | 19 |
+ *     | 3,0| 3,1| 3,2| 3,3| 3,4|
  *     --------------------------
- *     | 20 | 21 | 22 | 23 | 24 |
+ *     | 4,0| 4,1| 4,2| 4,3| 4,4|
  *     --------------------------
  *
- * The nodes holds the indices of their parent or child nodes. You can
- * map an index bijective to the related (row,col) tuple:
- *
- *     row = i / grid_width
- *     col = i % grid_width
- * 
  * The tree has the following structure:
  *
-
  *    ○--○--○--○--○
  *          |
  *    ○--○--○--○--○
@@ -81,142 +45,106 @@ typedef struct Node
  *    ○--○--○--○--○
  *          |
  *    ○--○--○--○--○
- * 
+ *
+ * Because the topology is fixed, nothing is stored per node. The relations
+ * follow from the position (row, col) of a node:
+ *
+ *     col <  middle    parent is (row, col + 1), leaf if col == 0
+ *     col == middle    parent is (row - 1, col), root if row == 0. Children
+ *                      are (row, col - 1), (row + 1, col) and (row, col + 1)
+ *     col >  middle    parent is (row, col - 1), leaf if col == cols - 1
+ *
+ * The grid does not cover the whole image. We crop a vertical strip on the
+ * left side of the image, because we use block matching. The offset is the
+ * width of this strip.
  */
-class Tree
+class CombTree
 {
   public:
-    std::vector<Node> nodes;
-    std::vector<int>  leafs; // indices of the nodes that are leafs
-    int               root;  // index of the root node
+    const int rows;
+    const int cols;
+    const int middle; // column of the vertical spine
+    const int offset; // width of the cropped strip on the left side of the image
 
-    Tree(const int rows, const int cols) : root(none)
+    CombTree(const int rows, const int cols, const int offset)
+        : rows(rows), cols(cols), middle(cols / 2), offset(offset)
     {
-        const int middle = cols / 2;
-
-        // initialize tree hierarchy with number of elements in the matrix
-        nodes = vector<Node>(rows * cols);
-
-        // generate grid spanning tree
-        for (int row = 0; row < rows; row++) {
-            for (int col = 0; col < cols; col++) {
-                const int i = row * cols + col;
-                Node node;
-                
-                // left
-                if (col < middle) {
-                    node.parent   = row * cols + col + 1; // node to the right is parent
-                    // node to the left
-                    if (col > 0) {
-                        node.children[0] = row * cols + col - 1;
-                    }
-                    // there is no right child, therefore the node is a leaf
-                    else {
-                        leafs.push_back(i);
-                    }
-                }
-                // middle
-                else if (col == middle) {
-                    // check if the parent nodes above exists
-                    if (row > 0) {
-                        node.parent = (row - 1) * cols + col;
-                    }
-                    // if not, we have found the root node
-                    else {
-                        root = i;
-                    }
-
-                    // left and right child nodes
-                    node.children[0] = row * cols + col - 1;
-                    node.children[2] = row * cols + col + 1;
-                    // check if the node below exists
-                    if (row + 1 < rows) {
-                        node.children[1] = (row + 1) * cols + col;
-                    }
-                }
-                // right 
-                else {
-                    node.parent = row * cols + col - 1;
-
-                    // node the the right is child
-                    if (col + 1 < cols) {
-                        node.children[2] = row * cols + col + 1;
-                    }
-                    // there is no right child, therefore the node is a leaf
-                    else {
-                        leafs.push_back(i);
-                    }
-                }
-                nodes[i] = node;
-            }
-        }
-
-        assert(root != none);
+        assert(rows > 0 && cols > 2);
     }
 
-    ~Tree()
+    // comb with the spine in another column than the middle one
+    CombTree(const int rows, const int cols, const int offset, const int middle)
+        : rows(rows), cols(cols), middle(middle), offset(offset)
     {
-        // cout << "Destruct Tree ..." << endl;
-
-        // delete all old costs
-        for (int i = 0; i < nodes.size(); i++) {
-            if (nodes[i].costs != nullptr) {
-                // cout << "Delete " << i << endl;
-                delete nodes[i].costs;
-            }
-        }
-    };
-
-    // some neat shortcuts
-    inline const Node& operator[] (const int i) const { return nodes[i];     }
-    inline       Node& operator[] (const int i)       { return nodes[i];     }
-    inline const int   size()                         { return nodes.size(); }
-
-    /**
-     * Descide for a node if all child nodes have already be calculated.
-     * 
-     * @return true if the costs for all child nodes are already calculated
-     */
-    inline bool canCalculate(int i)
-    {
-        const Node& node = nodes[i];
-
-        if (node.children[0] != none && nodes[node.children[0]].costs == nullptr) { return false; }
-        if (node.children[1] != none && nodes[node.children[1]].costs == nullptr) { return false; }
-        if (node.children[2] != none && nodes[node.children[2]].costs == nullptr) { return false; }
-
-        return true;
+        assert(rows > 0 && cols > 2 && middle > 0 && middle < cols - 1);
     }
+
+    // converts the position of a node into image coordinates
+    inline tuple<int, int> pixel(const int row, const int col) const { return make_tuple(row, col + offset); }
 };
 
 
-ostream& operator<<(ostream& os, const Tree& tree)
+/**
+ * The comb tree rotated by 90 degrees. The chains are the columns of the image
+ * and the spine is a horizontal line:
+ *
+ *    ○  ○  ○  ○  ○
+ *    |  |  |  |  |
+ *    ○  ○  ○  ○  ○
+ *    |  |  |  |  |
+ *    ○--○--○--○--○
+ *    |  |  |  |  |
+ *    ○  ○  ○  ○  ○
+ *    |  |  |  |  |
+ *    ○  ○  ○  ○  ○
+ *
+ * The tree coordinates are the same as for CombTree, only pixel() transposes
+ * them. Therefore rows is the number of image columns and cols the number of
+ * image rows covered by the tree.
+ */
+class VerticalCombTree
 {
-    for (int i = 0; i < tree.nodes.size(); i++) {
-        os << setw(2) << i                         << ": "
-           << setw(3) << tree.nodes[i].parent      << " | "
-           << setw(2) << tree.nodes[i].children[0] << " "
-           << setw(2) << tree.nodes[i].children[1] << " "
-           << setw(2) << tree.nodes[i].children[2] << endl;
+  public:
+    const int rows;
+    const int cols;
+    const int middle; // image row of the horizontal spine
+    const int offset; // width of the cropped strip on the left side of the image
+
+    VerticalCombTree(const int rows, const int cols, const int offset, const int middle)
+        : rows(rows), cols(cols), middle(middle), offset(offset)
+    {
+        assert(rows > 0 && cols > 2 && middle > 0 && middle < cols - 1);
     }
 
-    return os;
-}
+    inline tuple<int, int> pixel(const int row, const int col) const { return make_tuple(col, row + offset); }
+};
 
 
 /**
- * The tree is stored as a list. The nodes have stores the specific indices of their parent or child nodes.
- * You can convert an index back into an (row, col) if you now the image width and the window size.
- *
- * The windows size is important, because we crop a vertical strip on the left side of the image. This
- * is required because we use block matching.
+ * Calls body(i) for every i in [0, n) on a pool of num_threads threads. The
+ * indices are handed out dynamically, so chains of different lengths are
+ * balanced between the threads.
  */
-inline tuple<int, int> convertIndex(const int index, const int image_width)
+template <typename Body>
+void parallelFor(const int n, const int num_threads, Body body)
 {
-    return make_tuple(
-        index / (image_width - conversion_offset),                    // row
-        index % (image_width - conversion_offset) + conversion_offset // col
-    );
+    atomic<int> next(0);
+
+    auto worker = [&]() {
+        for (int i = next++; i < n; i = next++) {
+            body(i);
+        }
+    };
+
+    vector<thread> threads;
+    for (int t = 1; t < num_threads && t < n; t++) {
+        threads.push_back(thread(worker));
+    }
+    worker(); // the calling thread works too
+
+    for (int t = 0; t < threads.size(); t++) {
+        threads[t].join();
+    }
 }
 
 
@@ -241,7 +169,25 @@ static void usage()
          << "                            Available:"                                             << endl
          << "                              - tree"                                               << endl
          << "                              - line"                                               << endl
-         << "                          Default: tree"                                            << endl;
+         << "                              - multi (multiple trees, see --trees)"                << endl
+         << "                          Default: tree"                                            << endl
+         << "    -n, --trees           Number of trees for the multi topology (1 - 4)."          << endl
+         << "                          Default: 4"                                               << endl
+         << "    -j, --threads         Number of threads used for the tree and multi topology."  << endl
+         << "                          Default: number of CPU cores"                             << endl
+         << "    -p, --precision       Type of the costs used for the tree topology"             << endl
+         << "                            Available:"                                             << endl
+         << "                              - double"                                             << endl
+         << "                              - float"                                              << endl
+         << "                              - u32 (unsigned 32 bit integer)"                      << endl
+         << "                              - u16 (saturated unsigned 16 bit integer)"            << endl
+         << "                          Default: double"                                          << endl
+         << "    -b, --baseline        Compare the disparity map with the one computed with"     << endl
+         << "                          double precision and print the differences"               << endl
+         << "    -M, --memory-limit    Memory limit in MB for the path pointers of the tree"     << endl
+         << "                          topology. If they do not fit, the image is processed"     << endl
+         << "                          in strips of rows that are recomputed in the backward"    << endl
+         << "                          pass. Default: unlimited"                                 << endl;
 }
 
 
@@ -365,152 +311,695 @@ void calcDisparityLine(const Mat& left, const Mat& right, Mat& disparity,
 }
 
 
-void calcDisparityTree(const Mat& left, const Mat& right, Tree& tree, Mat& disparity,
-                       const int window_size, const int max_disparity, cost_t cost_fn, const double cost_factor)
+/**
+ * Arithmetic of the different types of messages (costs) used in the tree
+ * dynamic programming. Floating point costs are added as usual. Unsigned
+ * integer costs saturate at their maximum instead of wrapping around.
+ *
+ * Except for double, the costs of every node are normalized (the minimum is
+ * subtracted), so they stay in a small range. This does not change the
+ * disparity with minimal costs. double is the unnormalized baseline.
+ */
+template <typename Cost>
+struct CostTraits
+{
+    static const bool is_integer = numeric_limits<Cost>::is_integer;
+    static const bool normalize  = !is_same<Cost, double>::value;
+
+    static inline Cost max() { return numeric_limits<Cost>::max(); }
+
+    static inline Cost add(const Cost a, const Cost b)
+    {
+        if (is_integer) {
+            const Cost sum = a + b;
+            return (sum < a) ? max() : sum;
+        }
+        return a + b;
+    }
+
+    // converts a (scaled) double cost into the cost type
+    static inline Cost quantize(const double value)
+    {
+        if (is_integer) {
+            return (value + 0.5 >= max()) ? max() : (Cost) (value + 0.5);
+        }
+        return (Cost) value;
+    }
+
+    /**
+     * Scaling factor for all costs. Normalized costs of a node are bounded by
+     * the maximal data costs plus the transition costs of its three child
+     * nodes. A node sums three of these, adds three transitions and its own
+     * data costs. Integer costs are scaled down so this sum fits into the type.
+     */
+    static double scale(const double data_max, const double trans_max)
+    {
+        if (!is_integer) {
+            return 1.0;
+        }
+        return std::min(1.0, max() / (4 * data_max + 12 * trans_max));
+    }
+};
+
+
+/**
+ * Computes the costs of a single tree node for all disparities from the costs of
+ * its child nodes.
+ *
+ * @param children      Costs of the child nodes in the order left, below, right.
+ *                      Missing children are nullptr.
+ * @param trans_costs   Scaled transition costs, trans_costs[k * max_disparity + k_prev]
+ * @param data_scale    Scaling factor for the matching costs (see CostTraits::scale())
+ * @param scratch       Buffer for max_disparity costs
+ * @param pointers      Output: best disparity of the child nodes for every disparity
+ * @param costs         Output: costs of the node
+ */
+template <typename Cost>
+static inline void calcNodeCosts(const Mat& left, const Mat& right, const int window_size, const int max_disparity,
+                                 const int row, const int col, const Cost* const children[3],
+                                 const vector<Cost>& trans_costs, const double data_scale,
+                                 Cost* scratch, uint8_t* pointers, Cost* costs)
+{
+    typedef CostTraits<Cost> traits;
+
+    for (int k = 0; k < max_disparity; k++) {
+        const Cost* trans = &trans_costs[k * max_disparity];
+
+        // sum up costs of all child nodes. The loops have no branches, so the
+        // compiler can process multiple disparities per instruction.
+        fill(scratch, scratch + max_disparity, Cost(0));
+
+        for (int c = 0; c < 3; c++) {
+            const Cost* child = children[c];
+
+            if (child != nullptr) {
+                for (int k_prev = 0; k_prev < max_disparity; k_prev++) {
+                    scratch[k_prev] = traits::add(scratch[k_prev], traits::add(child[k_prev], trans[k_prev]));
+                }
+            }
+        }
+
+        // compute next node with minimum costs
+        Cost min = scratch[0];
+
+        for (int k_prev = 1; k_prev < max_disparity; k_prev++) {
+            min = std::min(min, scratch[k_prev]);
+        }
+
+        // store the best predecessor, the first one if there are multiple
+        int best = 0;
+        while (scratch[best] != min) {
+            best++;
+        }
+        pointers[k] = best;
+
+        const double data = matchSSDColor(left, right, window_size, row, col, col - k);
+
+        costs[k] = traits::add(traits::quantize(data * data_scale), min);
+    }
+
+    if (traits::normalize) {
+        const Cost min = *min_element(costs, costs + max_disparity);
+
+        for (int k = 0; k < max_disparity; k++) {
+            costs[k] -= min;
+        }
+    }
+}
+
+
+/**
+ * Dynamic programming on the tree. The tree type is a policy describing the
+ * topology (see CombTree): it has to provide rows, cols, middle and
+ * pixel(row, col). The cost type defines the precision of
+ * the messages (double, float, uint32_t or uint16_t, see CostTraits).
+ *
+ * The two halves of every row are independent chains hanging off the vertical
+ * spine. They are computed in parallel, the spine serially afterwards. The
+ * backward pass runs the other way round: the spine serially and the rows in
+ * parallel. The result is identical to a purely serial run, because every node
+ * sees exactly the same child costs.
+ *
+ * The path pointers of the chains take one byte per node and disparity. If they
+ * do not fit into the memory limit, the rows are processed in strips. The
+ * forward pass keeps only the costs of the topmost chain nodes of every row
+ * as checkpoint. The backward pass recomputes the chains of every strip from
+ * the leafs before it follows their pointers.
+ *
+ * @param memory_limit  Maximal number of bytes for the path pointers and the
+ *                      checkpoints. 0 means unlimited.
+ * @return false if the memory limit is below the checkpoints and a single row
+ *         of path pointers
+ */
+template <typename Cost, class Tree>
+bool calcDisparityTree(const Mat& left, const Mat& right, const Tree& tree, Mat& disparity,
+                       const int window_size, const int max_disparity, cost_t cost_fn, const double cost_factor,
+                       const int num_threads, const size_t memory_limit)
 {
     // scale cost function:
     // 
     //    (max value of SSD color match) / max disparity * cost_factor
     // 
     const double cost_scale = 3 * (255.0 * 255.0) * (window_size * window_size) / max_disparity * cost_factor;
+
+    // the transition costs only depend on the disparities, so we compute them once
+    vector<double> trans_costs_double(max_disparity * max_disparity);
+
+    for (int k = 0; k < max_disparity; k++) {
+        for (int k_prev = 0; k_prev < max_disparity; k_prev++) {
+            trans_costs_double[k * max_disparity + k_prev] = cost_scale * cost_fn(k, k_prev);
+        }
+    }
+
+    // scale all costs, so they fit into the cost type
+    const double data_max  = 3 * (255.0 * 255.0) * (window_size * window_size);
+    const double trans_max = *max_element(trans_costs_double.begin(), trans_costs_double.end());
+    const double data_scale = CostTraits<Cost>::scale(data_max, trans_max);
+
+    vector<Cost> trans_costs(trans_costs_double.size());
+
+    for (int i = 0; i < trans_costs.size(); i++) {
+        trans_costs[i] = CostTraits<Cost>::quantize(trans_costs_double[i] * data_scale);
+    }
     
     // initialize disparity map matrix as a grayscale image
     disparity = Mat(left.size(), CV_8UC1);
 
-    vector<vector<int>> path_pointers(tree.size(), vector<int>(max_disparity));
-    stack<int> node_stack;
+    // costs of the topmost nodes of the left and right chain in each row, the only
+    // costs that have to be kept until the spine is computed
+    vector<Cost> left_costs (tree.rows * max_disparity, 0);
+    vector<Cost> right_costs(tree.rows * max_disparity, 0);
+
+    // path pointers of the spine nodes, spine_pointers[row * max_disparity + k]
+    // is the best disparity of the child nodes of (row, middle) for disparity k
+    vector<uint8_t> spine_pointers(tree.rows * max_disparity);
+
+    // number of rows whose chain pointers fit into the memory limit
+    const size_t row_bytes   = (size_t) tree.cols * max_disparity;
+    const size_t fixed_bytes = left_costs.size() * sizeof(Cost) * 2 + spine_pointers.size();
+    int strip_rows = tree.rows;
+
+    if (memory_limit > 0) {
+        const size_t min_bytes = fixed_bytes + row_bytes;
+        if (memory_limit < min_bytes) {
+            cerr << "Error: memory limit too small, at least " << ((min_bytes + (1 << 20) - 1) >> 20)
+                 << " MB are required" << endl;
+            return false;
+        }
+        strip_rows = std::min((memory_limit - fixed_bytes) / row_bytes, (size_t) tree.rows);
+    }
+    const bool recompute = strip_rows < tree.rows;
+
+    if (recompute) {
+        cout << "Process " << strip_rows << " rows per strip" << endl;
+    }
 
-    // populate stack with all leafs
-    for (int i = 0; i < tree.leafs.size(); i++) {
+    // chain_pointers[((row - strip_start) * cols + col) * max_disparity + k] is the best
+    // disparity of the child node of (row, col), if (row, col) has the disparity k
+    vector<uint8_t> chain_pointers(strip_rows * row_bytes);
+    int strip_start = 0;
 
-        // int row    = tree.leafs[i] / (left.cols - window_size);
-        // int col    = tree.leafs[i] % (left.cols - window_size) + window_size;
-        // cout << "leaf (" << row << "," << col << ")" << endl;
+    // path pointers of a node
+    auto pointers = [&](const int row, const int col) -> uint8_t* {
+        if (col == tree.middle) {
+            return &spine_pointers[row * max_disparity];
+        }
+        return &chain_pointers[((row - strip_start) * tree.cols + col) * max_disparity];
+    };
 
-        // initialize costs for the leaf with 0
-        Node& node = tree[tree.leafs[i]];
-        node.costs = new vector<double>(max_disparity, 0);
+    // costs of the leafs are zero
+    const vector<Cost> leaf_costs(max_disparity, 0);
 
-        // index of the parent node of the leaf
-        const int p = tree[tree.leafs[i]].parent;
+    // Computes the costs of node (row, col) and stores its path pointers
+    auto forward = [&](const int row, const int col, const Cost* const children[3], Cost* scratch, Cost* costs) {
+        int image_row, image_col;
+        tie(image_row, image_col) = tree.pixel(row, col);
 
-        if (tree.canCalculate(p)) {
-            node_stack.push(p);
+        calcNodeCosts(left, right, window_size, max_disparity, image_row, image_col, children, trans_costs,
+                      data_scale, scratch, pointers(row, col), costs);
+    };
 
-            // int row_p    = p / (left.cols - window_size);
-            // int col_p    = p % (left.cols - window_size) + window_size;
-            // cout << "push (" << row_p << "," << col_p << ")" << endl;
+    // Assigns the disparity of node (row, col) by following the path pointer of
+    // its parent (row_parent, col_parent)
+    auto backward = [&](const int row, const int col, const int row_parent, const int col_parent) {
+        int image_row, image_col;
+        tie(image_row, image_col) = tree.pixel(row, col);
+
+        int image_row_parent, image_col_parent;
+        tie(image_row_parent, image_col_parent) = tree.pixel(row_parent, col_parent);
+
+        // get the disparity value for the parent node
+        uchar disp_parent = disparity.at<uchar>(image_row_parent, image_col_parent);
+
+        // the pointer stores the best disparity of the predecessor node
+        disparity.at<uchar>(image_row, image_col) = pointers(row_parent, col_parent)[disp_parent];
+    };
+
+    // Computes the chains of a row and stores the costs of their topmost nodes
+    auto forwardChains = [&](const int row) {
+        // the costs of a chain node only depend on its predecessor, so two
+        // vectors are enough
+        vector<Cost> prev(max_disparity);
+        vector<Cost> current(max_disparity);
+        vector<Cost> scratch(max_disparity);
+
+        // left chain: from the leaf in the first column to the middle
+        prev = leaf_costs;
+        for (int col = 1; col < tree.middle; col++) {
+            const Cost* const children[3] = { &prev[0], nullptr, nullptr };
+            forward(row, col, children, &scratch[0], &current[0]);
+            swap(prev, current);
         }
-    }
+        copy(prev.begin(), prev.end(), left_costs.begin() + row * max_disparity);
+
+        // right chain: from the leaf in the last column to the middle
+        prev = leaf_costs;
+        for (int col = tree.cols - 2; col > tree.middle; col--) {
+            const Cost* const children[3] = { nullptr, nullptr, &prev[0] };
+            forward(row, col, children, &scratch[0], &current[0]);
+            swap(prev, current);
+        }
+        copy(prev.begin(), prev.end(), right_costs.begin() + row * max_disparity);
+    };
 
     // Forward path
     // 
-    while (!node_stack.empty()) {
-        const int i = node_stack.top();
-        node_stack.pop();
 
-        Node& node = tree[i];
-        int row, col;
-        tie(row, col) = convertIndex(i, left.cols);
-        
-        // where to go?
-        // cout << setw(2) << i << ": (" << row << "," << col << ")" <<  endl;
+    // all chains are independent subtrees, so they can be computed in parallel
+    for (strip_start = 0; strip_start < tree.rows; strip_start += strip_rows) {
+        const int strip_end = std::min(strip_start + strip_rows, tree.rows);
+
+        parallelFor(strip_end - strip_start, num_threads, [&](const int i) {
+            forwardChains(strip_start + i);
+        });
+    }
+
+    // the spine is computed serially from the bottom to the root
+    vector<Cost> spine_prev(max_disparity);
+    vector<Cost> spine_current(max_disparity);
+    vector<Cost> spine_scratch(max_disparity);
+
+    for (int row = tree.rows - 1; row >= 0; row--) {
+        const Cost* const children[3] = {
+            &left_costs[row * max_disparity],
+            (row + 1 < tree.rows) ? &spine_prev[0] : nullptr,
+            &right_costs[row * max_disparity]
+        };
+        forward(row, tree.middle, children, &spine_scratch[0], &spine_current[0]);
+        swap(spine_prev, spine_current);
+    }
+
+    // Backward pass
+    // 
+
+    // find disparity with minimal costs for the root node
+    const vector<Cost>& root_costs = spine_prev;
+    Cost min = numeric_limits<Cost>::max();
+
+    int root_row, root_col;
+    tie(root_row, root_col) = tree.pixel(0, tree.middle);
 
-        if (node.parent != none && tree.canCalculate(node.parent)) {
-            node_stack.push(node.parent);
+    for (int k = 0; k < max_disparity; k++) {
+        // update minimum and assign disparity value if a smaller node was found
+        if (root_costs[k] < min || k == 0) {
+            min = root_costs[k];
+            disparity.at<uchar>(root_row, root_col) = (uchar) k;
         }
+    }
+
+    // use the stored indices to get the minimal path along the spine
+    for (int row = 1; row < tree.rows; row++) {
+        backward(row, tree.middle, row - 1, tree.middle);
+    }
+
+    // follow the chains in every row from the middle to the leafs. If the rows
+    // were processed in strips, the pointers of the strip have to be recomputed.
+    for (strip_start = 0; strip_start < tree.rows; strip_start += strip_rows) {
+        const int strip_end = std::min(strip_start + strip_rows, tree.rows);
+
+        parallelFor(strip_end - strip_start, num_threads, [&](const int i) {
+            const int row = strip_start + i;
 
-        assert(node.costs == nullptr);
-        node.costs = new vector<double>(max_disparity);
+            if (recompute) {
+                forwardChains(row);
+            }
+
+            for (int col = tree.middle - 1; col >= 0; col--) {
+                backward(row, col, row, col + 1);
+            }
+            for (int col = tree.middle + 1; col < tree.cols; col++) {
+                backward(row, col, row, col - 1);
+            }
+        });
+    }
 
-        for (int k = 0; k < max_disparity && k <= col; k++) {
-            // compute next node with minimum costs
-            double min = numeric_limits<double>::max();
+    return true;
+}
 
-            for (int k_prev = 0; k_prev < max_disparity; k_prev++) {
 
-                // sum up costs of all child nodes
-                double cost_prev  = 0;
-                double trans_cost = cost_scale * cost_fn(k, k_prev);
-                if (node.children[0] != none) { cost_prev += (*tree[node.children[0]].costs)[k_prev] + trans_cost; }
-                if (node.children[1] != none) { cost_prev += (*tree[node.children[1]].costs)[k_prev] + trans_cost; }
-                if (node.children[2] != none) { cost_prev += (*tree[node.children[2]].costs)[k_prev] + trans_cost; }
+/**
+ * Matching costs of all pixels covered by the trees for all disparities. The
+ * volume is computed once and shared by all trees of the multi tree mode.
+ */
+class CostVolume
+{
+  public:
+    const int rows;
+    const int cols;
+    const int offset;
+    const int max_disparity;
+
+    CostVolume(const Mat& left, const Mat& right, const int rows, const int cols, const int offset,
+               const int window_size, const int max_disparity, const int num_threads)
+        : rows(rows), cols(cols), offset(offset), max_disparity(max_disparity),
+          costs((size_t) rows * cols * max_disparity)
+    {
+        parallelFor(rows, num_threads, [&](const int row) {
+            for (int col = offset; col < offset + cols; col++) {
+                float* pixel_costs = (*this)(row, col);
 
-                // a "better" minimum was found
-                if (cost_prev < min) {
-                    min = cost_prev;              // update minimum
-                    path_pointers[i][k] = k_prev; // store the best predecessor
+                for (int k = 0; k < max_disparity; k++) {
+                    pixel_costs[k] = matchSSDColor(left, right, window_size, row, col, col - k);
                 }
             }
+        });
+    }
+
+    // index of the first disparity of a pixel given in image coordinates
+    inline size_t index(const int row, const int col) const
+    {
+        return ((size_t) row * cols + col - offset) * max_disparity;
+    }
+
+    inline       float* operator() (const int row, const int col)       { return &costs[index(row, col)]; }
+    inline const float* operator() (const int row, const int col) const { return &costs[index(row, col)]; }
+    inline const float* operator[] (const size_t i)               const { return &costs[i];               }
+
+  private:
+    vector<float> costs;
+};
+
 
-            double cost = matchSSDColor(left, right, window_size, row, col, col - k) + min;
-            
-            (*node.costs)[k] = cost;
+/**
+ * Sends a min-sum message over an edge of the tree:
+ *
+ *     message(k) = min_{k_prev} belief(k_prev) + trans_costs(k, k_prev)
+ *
+ * The message is normalized to a minimum of zero to keep float costs small.
+ */
+static inline void sendMessage(const float* belief, const vector<float>& trans_costs, const int max_disparity,
+                               float* message)
+{
+    for (int k = 0; k < max_disparity; k++) {
+        const float* trans = &trans_costs[k * max_disparity];
+        float min = belief[0] + trans[0];
+
+        for (int k_prev = 1; k_prev < max_disparity; k_prev++) {
+            min = std::min(min, belief[k_prev] + trans[k_prev]);
         }
+        message[k] = min;
+    }
 
-        // costs of the child nodes are no longer needed, so we free it and set the pointer to null
-        if (node.children[0] != none) { delete tree[node.children[0]].costs; tree[node.children[0]].costs = nullptr; }
-        if (node.children[1] != none) { delete tree[node.children[1]].costs; tree[node.children[1]].costs = nullptr; }
-        if (node.children[2] != none) { delete tree[node.children[2]].costs; tree[node.children[2]].costs = nullptr; }
+    const float min = *min_element(message, message + max_disparity);
 
-        if (node.parent != none && tree.canCalculate(node.parent)) {
-            node_stack.push(node.parent);
+    for (int k = 0; k < max_disparity; k++) {
+        message[k] -= min;
+    }
+}
+
+
+/**
+ * Computes the min-marginals of all nodes of a comb tree with min-sum belief
+ * propagation. In contrast to calcDisparityTree(), every node has its own
+ * matching costs and every edge is penalized exactly once, so the min-marginal
+ * of a node is the minimal energy of the whole tree for each of its disparities.
+ *
+ * The messages are passed in three steps:
+ *
+ *   1. along every row towards the spine (rows in parallel)
+ *   2. up and down the spine (serially)
+ *   3. along every row from the spine to the leafs (rows in parallel)
+ *
+ * @param marginals  Output volume (same layout as the cost volume). It is also
+ *                   used to store the messages of the first step.
+ */
+template <class Tree>
+void calcMinMarginals(const CostVolume& volume, const Tree& tree, const vector<float>& trans_costs,
+                      const int num_threads, vector<float>& marginals)
+{
+    const int max_disparity = volume.max_disparity;
+
+    // index of the first disparity of a tree node in the volumes
+    auto slot = [&](const int row, const int col) {
+        int image_row, image_col;
+        tie(image_row, image_col) = tree.pixel(row, col);
+
+        return volume.index(image_row, image_col);
+    };
+
+    // messages from the left and the right half of every row into the spine node
+    vector<float> spine_left (tree.rows * max_disparity);
+    vector<float> spine_right(tree.rows * max_disparity);
+
+    // 1. Messages towards the spine. The slot of every node stores the message
+    //    coming from its leaf.
+    parallelFor(tree.rows, num_threads, [&](const int row) {
+        vector<float> belief(max_disparity);
+
+        // from the left leaf to the spine
+        fill(&marginals[slot(row, 0)], &marginals[slot(row, 0)] + max_disparity, 0.0f);
+        for (int col = 1; col <= tree.middle; col++) {
+            const float* data     = volume[slot(row, col - 1)];
+            const float* incoming = &marginals[slot(row, col - 1)];
+            float*       message  = (col < tree.middle) ? &marginals[slot(row, col)] : &spine_left[row * max_disparity];
+
+            for (int k = 0; k < max_disparity; k++) {
+                belief[k] = data[k] + incoming[k];
+            }
+            sendMessage(&belief[0], trans_costs, max_disparity, message);
         }
+
+        // from the right leaf to the spine
+        fill(&marginals[slot(row, tree.cols - 1)], &marginals[slot(row, tree.cols - 1)] + max_disparity, 0.0f);
+        for (int col = tree.cols - 2; col >= tree.middle; col--) {
+            const float* data     = volume[slot(row, col + 1)];
+            const float* incoming = &marginals[slot(row, col + 1)];
+            float*       message  = (col > tree.middle) ? &marginals[slot(row, col)] : &spine_right[row * max_disparity];
+
+            for (int k = 0; k < max_disparity; k++) {
+                belief[k] = data[k] + incoming[k];
+            }
+            sendMessage(&belief[0], trans_costs, max_disparity, message);
+        }
+    });
+
+    // 2. Messages along the spine. spine_down[row] comes from the node above,
+    //    spine_up[row] from the node below.
+    vector<float> spine_down(tree.rows * max_disparity, 0);
+    vector<float> spine_up  (tree.rows * max_disparity, 0);
+    vector<float> belief(max_disparity);
+
+    // belief of a spine node without the message from the spine neighbor
+    auto spineBelief = [&](const int row, const float* spine_message) {
+        const float* data = volume[slot(row, tree.middle)];
+
+        for (int k = 0; k < max_disparity; k++) {
+            belief[k] = data[k] + spine_left[row * max_disparity + k] + spine_right[row * max_disparity + k]
+                      + spine_message[k];
+        }
+    };
+
+    for (int row = 1; row < tree.rows; row++) {
+        spineBelief(row - 1, &spine_down[(row - 1) * max_disparity]);
+        sendMessage(&belief[0], trans_costs, max_disparity, &spine_down[row * max_disparity]);
+    }
+    for (int row = tree.rows - 2; row >= 0; row--) {
+        spineBelief(row + 1, &spine_up[(row + 1) * max_disparity]);
+        sendMessage(&belief[0], trans_costs, max_disparity, &spine_up[row * max_disparity]);
     }
 
-    // Backward pass
-    // 
+    // 3. Messages from the spine to the leafs. The min-marginal of a node is its
+    //    data costs plus all incoming messages.
+    parallelFor(tree.rows, num_threads, [&](const int row) {
+        vector<float> belief(max_disparity);
+        vector<float> message(max_disparity);
+        vector<float> next(max_disparity);
+
+        const int    middle = slot(row, tree.middle);
+        const float* data   = volume[middle];
+        const float* left   = &spine_left [row * max_disparity];
+        const float* right  = &spine_right[row * max_disparity];
+        const float* down   = &spine_down [row * max_disparity];
+        const float* up     = &spine_up   [row * max_disparity];
+
+        // message into the left half: everything of the spine node except the left half
+        for (int k = 0; k < max_disparity; k++) {
+            belief[k] = data[k] + right[k] + down[k] + up[k];
+        }
+        sendMessage(&belief[0], trans_costs, max_disparity, &message[0]);
 
-    assert(tree[tree.root].costs != nullptr);
-    assert(node_stack.size() == 0);
+        for (int col = tree.middle - 1; col >= 0; col--) {
+            const float* node_data = volume[slot(row, col)];
+            float*       node      = &marginals[slot(row, col)]; // holds the message from the left
 
-    // find disparity with minimal costs for the root node
-    double min = numeric_limits<double>::max();
+            for (int k = 0; k < max_disparity; k++) {
+                belief[k] = node_data[k] + message[k];
+                node[k]  += belief[k];
+            }
+            if (col > 0) {
+                sendMessage(&belief[0], trans_costs, max_disparity, &next[0]);
+                swap(message, next);
+            }
+        }
+
+        // message into the right half
+        for (int k = 0; k < max_disparity; k++) {
+            belief[k] = data[k] + left[k] + down[k] + up[k];
+        }
+        sendMessage(&belief[0], trans_costs, max_disparity, &message[0]);
+
+        for (int col = tree.middle + 1; col < tree.cols; col++) {
+            const float* node_data = volume[slot(row, col)];
+            float*       node      = &marginals[slot(row, col)]; // holds the message from the right
+
+            for (int k = 0; k < max_disparity; k++) {
+                belief[k] = node_data[k] + message[k];
+                node[k]  += belief[k];
+            }
+            if (col < tree.cols - 1) {
+                sendMessage(&belief[0], trans_costs, max_disparity, &next[0]);
+                swap(message, next);
+            }
+        }
 
-    vector<double>& root_costs = *tree[tree.root].costs;
+        // the spine node itself
+        for (int k = 0; k < max_disparity; k++) {
+            marginals[middle + k] = data[k] + left[k] + right[k] + down[k] + up[k];
+        }
+    });
+}
+
+
+/**
+ * Multi tree aggregation. Runs the min-sum belief propagation on multiple comb
+ * trees (horizontal and vertical combs with the spine in the middle, and both
+ * with the spine at one quarter of the image) and sums up the min-marginals of
+ * all trees. The disparity of a pixel is the one with the minimal sum. Unlike
+ * the single comb, information can cross the rows at multiple places.
+ *
+ * All trees share the same cost volume and run on their own thread.
+ */
+void calcDisparityMultiTree(const Mat& left, const Mat& right, Mat& disparity, const int num_trees,
+                            const int window_size, const int max_disparity, cost_t cost_fn, const double cost_factor,
+                            const int num_threads)
+{
+    // see calcDisparityTree()
+    const double cost_scale = 3 * (255.0 * 255.0) * (window_size * window_size) / max_disparity * cost_factor;
+
+    vector<float> trans_costs(max_disparity * max_disparity);
 
     for (int k = 0; k < max_disparity; k++) {
-        // update minimum and assign disparity value if a smaller node was found
-        if (root_costs[k] < min) {
-            min = root_costs[k];
-            int row, col;
-            tie(row, col) = convertIndex(tree.root, left.cols);
-            disparity.at<uchar>(row, col) = (uchar) k;
+        for (int k_prev = 0; k_prev < max_disparity; k_prev++) {
+            trans_costs[k * max_disparity + k_prev] = cost_scale * cost_fn(k, k_prev);
         }
     }
 
-    // initial population of the child node stack (depth first search approach because of small
-    // memory usage)
-    if (tree[tree.root].children[0] != none) { node_stack.push(tree[tree.root].children[0]); }
-    if (tree[tree.root].children[1] != none) { node_stack.push(tree[tree.root].children[1]); }
-    if (tree[tree.root].children[2] != none) { node_stack.push(tree[tree.root].children[2]); }
+    // region of the image covered by the trees
+    const int offset = max_disparity + window_size;
+    const int rows   = left.rows - offset;
+    const int cols   = left.cols - offset;
 
-    // use the stored indices to get the minimal path
-    while (!node_stack.empty()) {
-        int i = node_stack.top();  // index of the current node
-        int p = tree[i].parent;    // index of parent node
-        node_stack.pop();
+    const CostVolume volume(left, right, rows, cols, offset, window_size, max_disparity, num_threads);
 
-        assert(p != none);
+    // every tree gets its own thread, the remaining threads are used for the rows
+    const int tree_threads = max(1, num_threads / num_trees);
 
-        // compute row an columns from the indices
-        int row, col;
-        tie(row, col)  = convertIndex(i, left.cols);
+    vector<vector<float>> marginals(num_trees);
 
-        int row_parent, col_parent;
-        tie(row_parent, col_parent) = convertIndex(p, left.cols);
+    parallelFor(num_trees, num_trees, [&](const int t) {
+        marginals[t].resize((size_t) rows * cols * max_disparity);
 
-        // get the disparity value for the parent node
-        uchar disp_parent = disparity.at<uchar>(row_parent, col_parent);
+        switch (t) {
+            case 0: calcMinMarginals(volume, CombTree        (rows, cols, offset, cols / 2), trans_costs, tree_threads, marginals[t]); break;
+            case 1: calcMinMarginals(volume, VerticalCombTree(cols, rows, offset, rows / 2), trans_costs, tree_threads, marginals[t]); break;
+            case 2: calcMinMarginals(volume, CombTree        (rows, cols, offset, cols / 4), trans_costs, tree_threads, marginals[t]); break;
+            case 3: calcMinMarginals(volume, VerticalCombTree(cols, rows, offset, rows / 4), trans_costs, tree_threads, marginals[t]); break;
+        }
+    });
 
-        // the pointer stores the best disparity of the predecessor node
-        disparity.at<uchar>(row, col) = (uchar) path_pointers[p][disp_parent];
+    // combine the min-marginals of all trees
+    disparity = Mat::zeros(left.size(), CV_8UC1);
+
+    parallelFor(rows, num_threads, [&](const int row) {
+        vector<float> sum(max_disparity);
+
+        for (int col = offset; col < left.cols; col++) {
+            const size_t i = volume.index(row, col);
+
+            fill(sum.begin(), sum.end(), 0.0f);
+
+            for (int t = 0; t < num_trees; t++) {
+                const float* marginal = &marginals[t][i];
+                const float  min      = *min_element(marginal, marginal + max_disparity);
+
+                for (int k = 0; k < max_disparity; k++) {
+                    sum[k] += marginal[k] - min;
+                }
+            }
+
+            disparity.at<uchar>(row, col) = (uchar) (min_element(sum.begin(), sum.end()) - sum.begin());
+        }
+    });
+}
+
+
+/**
+ * Dispatches the tree dynamic programming to the cost type with the given name
+ */
+template <class Tree>
+bool calcDisparityTree(const string& precision, const Mat& left, const Mat& right, const Tree& tree, Mat& disparity,
+                       const int window_size, const int max_disparity, cost_t cost_fn, const double cost_factor,
+                       const int num_threads, const size_t memory_limit)
+{
+    if (precision == "double") {
+        return calcDisparityTree<double>  (left, right, tree, disparity, window_size, max_disparity, cost_fn, cost_factor, num_threads, memory_limit);
+    } else if (precision == "float") {
+        return calcDisparityTree<float>   (left, right, tree, disparity, window_size, max_disparity, cost_fn, cost_factor, num_threads, memory_limit);
+    } else if (precision == "u32") {
+        return calcDisparityTree<uint32_t>(left, right, tree, disparity, window_size, max_disparity, cost_fn, cost_factor, num_threads, memory_limit);
+    } else { // precision == "u16"
+        return calcDisparityTree<uint16_t>(left, right, tree, disparity, window_size, max_disparity, cost_fn, cost_factor, num_threads, memory_limit);
+    }
+}
+
+
+/**
+ * Prints the differences of a disparity map to the baseline computed with double
+ * precision. Only the region covered by the tree is compared.
+ */
+static void printDeltas(const Mat& disparity, const Mat& baseline, const Rect& region)
+{
+    int    num_different = 0;
+    double sum_abs_delta = 0;
+    int    max_abs_delta = 0;
 
-        // add child nodes of the current 
-        if (tree[i].children[0] != none) { node_stack.push(tree[i].children[0]); }
-        if (tree[i].children[1] != none) { node_stack.push(tree[i].children[1]); }
-        if (tree[i].children[2] != none) { node_stack.push(tree[i].children[2]); }
+    for (int row = region.y; row < region.y + region.height; row++) {
+        for (int col = region.x; col < region.x + region.width; col++) {
+            const int delta = abs(disparity.at<uchar>(row, col) - baseline.at<uchar>(row, col));
+
+            if (delta != 0) {
+                num_different++;
+            }
+            sum_abs_delta += delta;
+            max_abs_delta  = max(max_abs_delta, delta);
+        }
     }
+
+    cout << "Deltas to double baseline:"                                                   << endl
+         << "  different pixels : " << num_different << " ("
+                                    << 100.0 * num_different / region.area() << "%)"     << endl
+         << "  mean abs delta   : " << sum_abs_delta / region.area()                       << endl
+         << "  max abs delta    : " << max_abs_delta                                       << endl;
 }
 
 
@@ -528,6 +1017,11 @@ int main(int argc, char const *argv[])
     string output         = "disparity.png";
     string cost_fn_name   = "abs_diff";
     cost_t cost_fn        = &abs_diff;
+    int    num_threads    = max(1u, thread::hardware_concurrency());
+    string precision      = "double";
+    bool   baseline       = false;
+    int    num_trees      = 4;
+    size_t memory_limit   = 0;
 
     const struct option long_options[] = {
         { "help",           no_argument,       0, 'h' },
@@ -537,13 +1031,18 @@ int main(int argc, char const *argv[])
         { "scale-cost",     required_argument, 0, 's' },
         { "topology",       required_argument, 0, 't' },
         { "cost",           required_argument, 0, 'c' },
+        { "threads",        required_argument, 0, 'j' },
+        { "precision",      required_argument, 0, 'p' },
+        { "baseline",       no_argument,       0, 'b' },
+        { "trees",          required_argument, 0, 'n' },
+        { "memory-limit",   required_argument, 0, 'M' },
         0 // end of parameter list
     };
 
     // parse command line options
     while (true) {
         int index  = -1;
-        int result = getopt_long(argc, (char **) argv, "hw:o:d:s:t:c:", long_options, &index);
+        int result = getopt_long(argc, (char **) argv, "hw:o:d:s:t:c:j:p:bn:M:", long_options, &index);
 
         // end of parameter list
         if (result == -1) {
@@ -568,7 +1067,7 @@ int main(int argc, char const *argv[])
             // maximal disparity
             case 'd':
                 max_disparity = stoi(string(optarg));
-                if (max_disparity <= 0) {
+                if (max_disparity <= 0 || max_disparity > 256) {
                     cerr << argv[0] << ": Invalid maximal disparity: " << optarg << endl;
                     return 1;
                 }
@@ -604,13 +1103,54 @@ int main(int argc, char const *argv[])
             // topology
             case 't':
                 topology = string(optarg);
-                if (topology != "tree" && topology != "line") {
+                if (topology != "tree" && topology != "line" && topology != "multi") {
                     cerr << argv[0] << ": Invalid topology: " << optarg << endl;
                     return 1;
                 }
 
                 break;
 
+            // number of threads
+            case 'j':
+                num_threads = stoi(string(optarg));
+                if (num_threads <= 0) {
+                    cerr << argv[0] << ": Invalid number of threads: " << optarg << endl;
+                    return 1;
+                }
+                break;
+
+            // precision of the costs
+            case 'p':
+                precision = string(optarg);
+                if (precision != "double" && precision != "float" && precision != "u32" && precision != "u16") {
+                    cerr << argv[0] << ": Invalid precision: " << optarg << endl;
+                    return 1;
+                }
+                break;
+
+            // number of trees for the multi topology
+            case 'n':
+                num_trees = stoi(string(optarg));
+                if (num_trees < 1 || num_trees > 4) {
+                    cerr << argv[0] << ": Invalid number of trees: " << optarg << endl;
+                    return 1;
+                }
+                break;
+
+            // memory limit in MB
+            case 'M':
+                memory_limit = stoul(string(optarg)) << 20;
+                if (memory_limit == 0) {
+                    cerr << argv[0] << ": Invalid memory limit: " << optarg << endl;
+                    return 1;
+                }
+                break;
+
+            // compare with double precision
+            case 'b':
+                baseline = true;
+                break;
+
            // missing option
            case '?':
                 return 1;
@@ -636,6 +1176,12 @@ int main(int argc, char const *argv[])
         cerr << "Error: Windows size must be smaller than the image" << endl;
         return 1;
     }
+    // the multi and line topologies always run in double with full path pointers
+    if (topology != "tree" && (precision != "double" || baseline || memory_limit > 0)) {
+        cerr << "Error: --precision, --baseline and --memory-limit are not supported by the "
+             << topology << " topology" << endl;
+        return 1;
+    }
 
     cout << "Parameters:"                          << endl
          << "  window size   : " << window_size    << endl
@@ -643,14 +1189,28 @@ int main(int argc, char const *argv[])
          << "  topology      : " << topology       << endl
          << "  cost scale    : " << cost_scale     << endl
          << "  cost function : " << cost_fn_name   << endl
+         << "  threads       : " << num_threads    << endl
+         << "  precision     : " << precision      << endl
          << "  output        : " << output         << endl;
 
     disparity = Mat::zeros(left.size(), CV_8UC1);
 
     if (topology == "tree") {
-        conversion_offset = max_disparity + window_size;
-        Tree tree(left.rows - conversion_offset, left.cols - conversion_offset);
-        calcDisparityTree(left, right, tree, disparity, window_size, max_disparity, cost_fn, cost_scale);
+        const int offset = max_disparity + window_size;
+        CombTree tree(left.rows - offset, left.cols - offset, offset);
+        if (!calcDisparityTree(precision, left, right, tree, disparity, window_size, max_disparity, cost_fn, cost_scale, num_threads, memory_limit)) {
+            return 1;
+        }
+
+        if (baseline) {
+            Mat disparity_double;
+            if (!calcDisparityTree<double>(left, right, tree, disparity_double, window_size, max_disparity, cost_fn, cost_scale, num_threads, memory_limit)) {
+                return 1;
+            }
+            printDeltas(disparity, disparity_double, Rect(offset, 0, tree.cols, tree.rows));
+        }
+    } else if (topology == "multi") {
+        calcDisparityMultiTree(left, right, disparity, num_trees, window_size, max_disparity, cost_fn, cost_scale, num_threads);
     } else { // topology == "line"
         calcDisparityLine(left, right, disparity, window_size, max_disparity, cost_fn, cost_scale);
     }